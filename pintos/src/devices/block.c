@@ -3,7 +3,14 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Most sectors the request queue moves in one transfer when it
+   merges adjacent requests. */
+#define BLOCK_MERGE_MAX 64
 
 /* A block device. */
 struct block
@@ -19,8 +26,24 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request queue, served by a thread started on the first
+       block_submit (). */
+    struct lock queue_lock;             /* Protects the members below. */
+    struct condition queue_ready;       /* Queue became non-empty. */
+    struct list queue;                  /* Pending requests, by sector. */
+    bool dispatching;                   /* Queue thread started? */
+    block_sector_t head;                /* Sector after the last transfer. */
+    size_t depth;                       /* Pending requests. */
+    size_t max_depth;                   /* Most pending requests seen. */
+    unsigned long long request_cnt;     /* Requests completed. */
+    unsigned long long transfer_cnt;    /* Transfers they took. */
+    int64_t latency;                    /* Total ticks from submission to
+                                           completion. */
   };
 
+static void block_dispatch (void *block_);
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -141,6 +164,202 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for CNT *
+   BLOCK_SECTOR_SIZE bytes.  Drivers that support it move the
+   whole run with a single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_read_multi (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_multi != NULL)
+    block->ops->read_multi (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i,
+                        (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->read_cnt += cnt;
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.  Drivers that support it move the whole run with a
+   single command.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+block_write_multi (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer)
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_multi != NULL)
+    block->ops->write_multi (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i,
+                         (const uint8_t *) buffer + i * BLOCK_SECTOR_SIZE);
+  block->write_cnt += cnt;
+}
+
+/* Orders requests by first sector. */
+static bool
+request_less (const struct list_elem *a, const struct list_elem *b,
+              void *aux UNUSED)
+{
+  return (list_entry (a, struct block_request, elem)->sector
+          < list_entry (b, struct block_request, elem)->sector);
+}
+
+/* Queues REQUEST on BLOCK and returns at once.  REQUEST->complete
+   is called from BLOCK's queue thread once the transfer is done.
+   It must not wait for other requests on BLOCK. */
+void
+block_submit (struct block *block, struct block_request *request)
+{
+  ASSERT (request->cnt > 0);
+  check_sector (block, request->sector);
+  check_sector (block, request->sector + request->cnt - 1);
+
+  lock_acquire (&block->queue_lock);
+  if (!block->dispatching)
+    {
+      char name[16];
+      snprintf (name, sizeof name, "%.9s-queue", block->name);
+      if (thread_create (name, PRI_DEFAULT, block_dispatch, block)
+          == TID_ERROR)
+        PANIC ("%s: cannot start request queue", block->name);
+      block->dispatching = true;
+    }
+  request->submitted = timer_ticks ();
+  list_insert_ordered (&block->queue, &request->elem, request_less, NULL);
+  if (++block->depth > block->max_depth)
+    block->max_depth = block->depth;
+  cond_signal (&block->queue_ready, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Removes from BLOCK's queue the next requests to serve and
+   stores them in BATCH, returning how many there are.  The queue
+   is served C-LOOK style: the first request at or above the end
+   of the previous transfer, or the lowest one if there is none,
+   and then the requests in the same direction that continue it,
+   which go to the device as a single transfer.
+   Must be called with the queue lock held and a non-empty queue. */
+static size_t
+next_batch (struct block *block, struct block_request **batch)
+{
+  struct list_elem *e;
+  struct block_request *r;
+  size_t n = 0, sectors;
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    if (list_entry (e, struct block_request, elem)->sector >= block->head)
+      break;
+  if (e == list_end (&block->queue))
+    e = list_begin (&block->queue);
+
+  r = list_entry (e, struct block_request, elem);
+  sectors = 0;
+  for (;;)
+    {
+      struct list_elem *next = list_next (e);
+      struct block_request *c = list_entry (e, struct block_request, elem);
+
+      list_remove (e);
+      batch[n++] = c;
+      sectors += c->cnt;
+      if (next == list_end (&block->queue))
+        break;
+      c = list_entry (next, struct block_request, elem);
+      if (c->write != r->write || c->sector != r->sector + sectors
+          || sectors + c->cnt > BLOCK_MERGE_MAX)
+        break;
+      e = next;
+    }
+  block->depth -= n;
+  block->head = r->sector + sectors;
+  return n;
+}
+
+/* Request queue thread of BLOCK.  Serves batches of adjacent
+   requests with one transfer each, through a bounce buffer when
+   a batch holds more than one request. */
+static void
+block_dispatch (void *block_)
+{
+  struct block *block = block_;
+  struct block_request *batch[BLOCK_MERGE_MAX];
+  uint8_t *bounce = malloc (BLOCK_MERGE_MAX * BLOCK_SECTOR_SIZE);
+
+  for (;;)
+    {
+      struct block_request *first;
+      size_t n, i, sectors = 0;
+      int64_t now;
+
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_ready, &block->queue_lock);
+      n = next_batch (block, batch);
+      lock_release (&block->queue_lock);
+
+      first = batch[0];
+      for (i = 0; i < n; i++)
+        sectors += batch[i]->cnt;
+      if (n == 1 || bounce == NULL)
+        {
+          for (i = 0; i < n; i++)
+            if (batch[i]->write)
+              block_write_multi (block, batch[i]->sector, batch[i]->cnt,
+                                 batch[i]->buffer);
+            else
+              block_read_multi (block, batch[i]->sector, batch[i]->cnt,
+                                batch[i]->buffer);
+        }
+      else if (first->write)
+        {
+          for (i = 0, sectors = 0; i < n; sectors += batch[i++]->cnt)
+            memcpy (bounce + sectors * BLOCK_SECTOR_SIZE, batch[i]->buffer,
+                    batch[i]->cnt * BLOCK_SECTOR_SIZE);
+          block_write_multi (block, first->sector, sectors, bounce);
+        }
+      else
+        {
+          block_read_multi (block, first->sector, sectors, bounce);
+          for (i = 0, sectors = 0; i < n; sectors += batch[i++]->cnt)
+            memcpy (batch[i]->buffer, bounce + sectors * BLOCK_SECTOR_SIZE,
+                    batch[i]->cnt * BLOCK_SECTOR_SIZE);
+        }
+
+      now = timer_ticks ();
+      lock_acquire (&block->queue_lock);
+      block->request_cnt += n;
+      block->transfer_cnt += bounce != NULL ? 1 : n;
+      for (i = 0; i < n; i++)
+        block->latency += now - batch[i]->submitted;
+      lock_release (&block->queue_lock);
+
+      for (i = 0; i < n; i++)
+        batch[i]->complete (batch[i]);
+    }
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -176,6 +395,12 @@ block_print_stats (void)
           printf ("%s (%s): %llu reads, %llu writes\n",
                   block->name, block_type_name (block->type),
                   block->read_cnt, block->write_cnt);
+          if (block->request_cnt > 0)
+            printf ("%s queue: %llu requests in %llu transfers, "
+                    "max depth %zu, average latency %lld ticks\n",
+                    block->name, block->request_cnt, block->transfer_cnt,
+                    block->max_depth,
+                    block->latency / (long long) block->request_cnt);
         }
     }
 }
@@ -202,6 +427,16 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  lock_init (&block->queue_lock);
+  cond_init (&block->queue_ready);
+  list_init (&block->queue);
+  block->dispatching = false;
+  block->head = 0;
+  block->depth = 0;
+  block->max_depth = 0;
+  block->request_cnt = 0;
+  block->transfer_cnt = 0;
+  block->latency = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -1,8 +1,10 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,9 +55,35 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multi (struct block *, block_sector_t, size_t cnt, void *);
+void block_write_multi (struct block *, block_sector_t, size_t cnt,
+                        const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* Asynchronous requests. */
+
+/* A request to read or write CNT consecutive sectors starting at
+   SECTOR, from or into BUFFER, which holds CNT *
+   BLOCK_SECTOR_SIZE bytes.  The submitter fills in the fields
+   up to AUX and keeps the request alive until COMPLETE is
+   called. */
+struct block_request
+  {
+    bool write;                         /* Write, or read? */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* Data. */
+    void (*complete) (struct block_request *); /* Called when done. */
+    void *aux;                          /* For the submitter. */
+
+    /* Owned by the request queue. */
+    struct list_elem elem;              /* In the device's queue. */
+    int64_t submitted;                  /* Timer tick of submission. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
 void block_print_stats (void);
 
@@ -65,6 +93,14 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Transfer CNT consecutive sectors at once.  Optional: a
+       driver that leaves these null gets one call to read or
+       write per sector. */
+    void (*read_multi) (void *aux, block_sector_t, size_t cnt,
+                        void *buffer);
+    void (*write_multi) (void *aux, block_sector_t, size_t cnt,
+                         const void *buffer);
   };
 
 struct block *block_register (const char *name, enum block_type,
@@ -8,7 +8,10 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -16,6 +19,7 @@
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
 #define reg_error(CHANNEL) ((CHANNEL)->reg_base + 1)    /* Error. */
+#define reg_features(CHANNEL) reg_error (CHANNEL)       /* Features (w/o). */
 #define reg_nsect(CHANNEL) ((CHANNEL)->reg_base + 2)    /* Sector Count. */
 #define reg_lbal(CHANNEL) ((CHANNEL)->reg_base + 3)     /* LBA 0:7. */
 #define reg_lbam(CHANNEL) ((CHANNEL)->reg_base + 4)     /* LBA 15:8. */
@@ -30,10 +34,29 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, for controllers that can do
+   DMA.  Each channel has its own set of registers. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_START 0x01           /* Start transfer. */
+#define BM_READ 0x08            /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_ERR 0x02             /* Error, write 1 to clear. */
+#define BM_INTR 0x04            /* Interrupt, write 1 to clear. */
+
+/* PCI configuration space access. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +72,26 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+#define CMD_SET_FEATURES 0xef           /* SET FEATURES. */
+
+/* SET FEATURES subcommand that selects the transfer mode given in
+   the Sector Count register. */
+#define FEATURE_TRANSFER_MODE 0x03
+#define MODE_MULTIWORD_DMA 0x20         /* Multiword DMA, ORed with mode. */
+#define MODE_ULTRA_DMA 0x40             /* Ultra DMA, ORed with mode. */
+
+/* Longest wait for a DMA transfer to complete, in timer ticks,
+   before the channel is reset and the transfer redone with PIO. */
+#define DMA_TIMEOUT (5 * TIMER_FREQ)
+
+/* Most sectors one command can transfer: a sector count of 0
+   means 256. */
+#define MAX_COMMAND_SECTORS 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +100,23 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt for READ/WRITE
+                                   MULTIPLE, 0 if not supported. */
+    bool dma;                   /* Use bus master DMA? */
   };
 
+/* A physical region descriptor: one physically contiguous piece
+   of memory taking part in a DMA transfer.  A piece may not cross
+   a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
+  };
+
+#define PRD_EOT 0x8000          /* End of table. */
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -72,6 +130,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master I/O port, 0 if no DMA. */
+    struct prd *prdt;           /* PRD table for DMA transfers. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -85,7 +146,13 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void set_multiple_mode (struct ata_disk *, int max_sectors);
+static bool set_dma_mode (struct ata_disk *, const char *id);
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          void *buffer, bool write);
+static void abort_dma (struct ata_disk *);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -102,6 +169,7 @@ void
 ide_init (void) 
 {
   size_t chan_no;
+  uint16_t bm_base = find_bus_master ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -126,6 +194,17 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+
+      /* The second channel's bus master registers follow the
+         first one's. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +215,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -303,6 +384,15 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Word 47 holds the most sectors the disk moves per interrupt
+     with READ/WRITE MULTIPLE. */
+  set_multiple_mode (d, (uint8_t) id[47 * 2]);
+
+  /* Word 49 bit 8 tells whether the disk can do DMA.  The disk
+     must also be told which DMA mode to use. */
+  d->dma = (c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0
+            && set_dma_mode (d, id));
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -347,12 +437,15 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  if (!dma_transfer (d, sec_no, 1, buffer, false))
+    {
+      select_sector (d, sec_no, 1);
+      issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
+      input_sector (c, buffer);
+    }
   lock_release (&c->lock);
 }
 
@@ -367,33 +460,371 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  if (!dma_transfer (d, sec_no, 1, (void *) buffer, true))
+    {
+      select_sector (d, sec_no, 1);
+      issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
+      output_sector (c, buffer);
+      sema_down (&c->completion_wait);
+    }
+  lock_release (&c->lock);
+}
+
+/* Returns the number of sectors disk D transfers between two
+   interrupts of a command that has LEFT sectors to go. */
+static size_t
+sectors_per_interrupt (const struct ata_disk *d, size_t left)
+{
+  if (d->multiple == 0)
+    return 1;
+  return left < (size_t) d->multiple ? left : (size_t) d->multiple;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Each command moves up to MAX_COMMAND_SECTORS sectors, with
+   READ MULTIPLE if the disk supports it so that it interrupts
+   once per block of sectors rather than once per sector.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multi (void *d_, block_sector_t sec_no, size_t cnt, void *buffer)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  uint8_t *p = buffer;
+
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      size_t left;
+
+      if (dma_transfer (d, sec_no, n, p, false))
+        p += n * BLOCK_SECTOR_SIZE;
+      else
+        {
+          select_sector (d, sec_no, n);
+          issue_pio_command (c, d->multiple > 0 ? CMD_READ_MULTIPLE
+                                                : CMD_READ_SECTOR_RETRY);
+          for (left = n; left > 0; )
+            {
+              size_t blk = sectors_per_interrupt (d, left);
+              sema_down (&c->completion_wait);
+              if (!wait_while_busy (d))
+                PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name,
+                       sec_no + (n - left));
+              for (left -= blk; blk > 0; blk--, p += BLOCK_SECTOR_SIZE)
+                input_sector (c, p);
+            }
+        }
+      sec_no += n;
+      cnt -= n;
+    }
+  lock_release (&c->lock);
+}
+
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes, as
+   ide_read_multi() does for reads.  Returns after the disk has
+   acknowledged receiving the data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multi (void *d_, block_sector_t sec_no, size_t cnt,
+                 const void *buffer)
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  const uint8_t *p = buffer;
+
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+      size_t left;
+
+      if (dma_transfer (d, sec_no, n, (void *) p, true))
+        p += n * BLOCK_SECTOR_SIZE;
+      else
+        {
+          select_sector (d, sec_no, n);
+          issue_pio_command (c, d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                                                : CMD_WRITE_SECTOR_RETRY);
+          for (left = n; left > 0; )
+            {
+              size_t blk = sectors_per_interrupt (d, left);
+              if (!wait_while_busy (d))
+                PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name,
+                       sec_no + (n - left));
+              for (left -= blk; blk > 0; blk--, p += BLOCK_SECTOR_SIZE)
+                output_sector (c, p);
+              sema_down (&c->completion_wait);
+            }
+        }
+      sec_no += n;
+      cnt -= n;
+    }
   lock_release (&c->lock);
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multi,
+    ide_write_multi
   };
 
+/* Returns the 32-bit register REG of PCI function FUNC of device
+   DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (dev << 11) | (func << 8) | (reg & 0xfc));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Sets the 32-bit register REG of PCI function FUNC of device DEV
+   on bus 0 to VALUE. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (dev << 11) | (func << 8) | (reg & 0xfc));
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that can act as a bus
+   master, such as the PIIX found in PCs and emulated by QEMU.
+   Enables bus mastering on it and returns the I/O port of its bus
+   master registers, or 0 if there is no such controller. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4;
+
+        if ((pci_read_config (dev, func, 0x00) & 0xffff) == 0xffff)
+          {
+            if (func == 0)
+              break;
+            continue;
+          }
+
+        /* Class 1 (mass storage), subclass 1 (IDE), with bit 7 of
+           the programming interface set for bus mastering. */
+        class = pci_read_config (dev, func, 0x08);
+        if ((class >> 16) != 0x0101 || !(class & 0x8000))
+          continue;
+
+        /* BAR4 holds the bus master registers, in I/O space. */
+        bar4 = pci_read_config (dev, func, 0x20);
+        if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space access and bus mastering.  The upper
+           half is the status register, whose bits are cleared by
+           writing 1, so leave it 0. */
+        pci_write_config (dev, func, 0x04,
+                          (pci_read_config (dev, func, 0x04) & 0xffff) | 0x5);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
+/* Picks the fastest DMA mode that disk D reports in ID, its
+   IDENTIFY DEVICE data, and selects it with SET FEATURES.
+   Returns false if D reports no DMA mode or rejects the
+   command. */
+static bool
+set_dma_mode (struct ata_disk *d, const char *id)
+{
+  struct channel *c = d->channel;
+  uint16_t modes;
+  uint8_t type;
+  int mode;
+
+  /* Word 88 holds the Ultra DMA modes supported, valid if word 53
+     bit 2 is set.  Word 63 holds the multiword DMA modes. */
+  modes = *(uint16_t *) &id[88 * 2] & 0x7f;
+  type = MODE_ULTRA_DMA;
+  if (!(*(uint16_t *) &id[53 * 2] & 0x4) || modes == 0)
+    {
+      modes = *(uint16_t *) &id[63 * 2] & 0x7;
+      type = MODE_MULTIWORD_DMA;
+      if (modes == 0)
+        return false;
+    }
+  for (mode = 6; !(modes & (1 << mode)); mode--)
+    continue;
+
+  select_device_wait (d);
+  outb (reg_features (c), FEATURE_TRANSFER_MODE);
+  outb (reg_nsect (c), type | mode);
+  issue_pio_command (c, CMD_SET_FEATURES);
+  sema_down (&c->completion_wait);
+  wait_until_idle (d);
+  return !(inb (reg_alt_status (c)) & STA_ERR);
+}
+
+/* Recovers the channel of disk D after a DMA transfer that never
+   completed: drops any completion interrupt that arrives late and
+   resets the channel.  The reset may also drop the transfer mode
+   set by SET FEATURES, so both disks on the channel go back to
+   PIO. */
+static void
+abort_dma (struct ata_disk *d)
+{
+  struct channel *c = d->channel;
+  enum intr_level old_level;
+  int dev_no;
+
+  outb (reg_bm_command (c), 0);
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_ERR | BM_INTR);
+  old_level = intr_disable ();
+  c->expecting_interrupt = false;
+  while (sema_try_down (&c->completion_wait))
+    continue;
+  intr_set_level (old_level);
+
+  reset_channel (c);
+
+  /* The reset also forgets the READ/WRITE MULTIPLE block size. */
+  for (dev_no = 0; dev_no < 2; dev_no++)
+    {
+      struct ata_disk *e = &c->devices[dev_no];
+      e->dma = false;
+      if (e->is_ata)
+        set_multiple_mode (e, e->multiple);
+    }
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D and
+   BUFFER with bus master DMA, from the disk to BUFFER if WRITE is
+   false and the other way if it is true.  The CPU only sets up
+   the transfer; the thread then sleeps until the completion
+   interrupt while the controller moves the data.
+
+   Returns false without doing anything if D does not use DMA or
+   BUFFER is not in kernel memory at an even address, so that the
+   caller falls back to PIO.  Also returns false, and stops using
+   DMA on D, if the transfer fails or does not complete within
+   DMA_TIMEOUT ticks.  The caller must hold the channel lock. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  struct prd *prd = c->prdt;
+  uintptr_t addr;
+  size_t size = cnt * BLOCK_SECTOR_SIZE;
+  uint8_t bm_status;
+  int64_t start;
+
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
+  if (!d->dma || !is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1))
+    return false;
+
+  /* Kernel memory is mapped to physical memory in one piece, so
+     BUFFER is physically contiguous.  Split it at 64 kB
+     boundaries. */
+  for (addr = vtop (buffer); ; prd++)
+    {
+      size_t piece = 0x10000 - (addr & 0xffff);
+      if (piece > size)
+        piece = size;
+      prd->addr = addr;
+      prd->size = piece & 0xffff;
+      prd->flags = 0;
+      addr += piece;
+      size -= piece;
+      if (size == 0)
+        break;
+    }
+  prd->flags = PRD_EOT;
+
+  outb (reg_bm_command (c), 0);
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_status (c), inb (reg_bm_status (c)) | BM_ERR | BM_INTR);
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), write ? BM_START : BM_START | BM_READ);
+
+  /* Semaphores have no timeout, so poll for the completion
+     interrupt, yielding the CPU in between. */
+  start = timer_ticks ();
+  while (!sema_try_down (&c->completion_wait))
+    {
+      if (timer_elapsed (start) >= DMA_TIMEOUT)
+        {
+          printf ("%s: DMA transfer timed out, sector=%"PRDSNu", "
+                  "using PIO\n", d->name, sec_no);
+          abort_dma (d);
+          return false;
+        }
+      thread_yield ();
+    }
+
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_command (c), 0);
+  outb (reg_bm_status (c), bm_status | BM_ERR | BM_INTR);
+  if ((bm_status & BM_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    {
+      printf ("%s: DMA transfer failed, sector=%"PRDSNu", using PIO\n",
+              d->name, sec_no);
+      d->dma = false;
+      return false;
+    }
+  return true;
+}
+
+/* Enables READ/WRITE MULTIPLE on disk D with the largest block
+   size allowed by the disk, which moves at most MAX_SECTORS
+   sectors per interrupt.  Leaves them disabled if MAX_SECTORS is
+   0 or the disk rejects the command. */
+static void
+set_multiple_mode (struct ata_disk *d, int max_sectors)
+{
+  struct channel *c = d->channel;
+  int n = 1;
+
+  d->multiple = 0;
+  if (max_sectors <= 0)
+    return;
+
+  /* The block size must be a power of 2. */
+  while (n * 2 <= max_sectors)
+    n *= 2;
+  select_device_wait (d);
+  outb (reg_nsect (c), n);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_until_idle (d);
+  if (!(inb (reg_alt_status (c)) & STA_ERR))
+    d->multiple = n;
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the number of sectors CNT to the disk's
+   sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_COMMAND_SECTORS);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_COMMAND_SECTORS ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
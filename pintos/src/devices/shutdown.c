@@ -12,6 +12,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "filesys/filesys.h"
+#include "filesys/buffer.h"
 #endif
 
 /* Keyboard control register port. */
@@ -125,6 +126,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  buffer_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
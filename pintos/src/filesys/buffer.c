@@ -1,147 +1,933 @@
 #include "filesys/buffer.h"
 #include <debug.h>
 #include <list.h>
+#include <hash.h>
+#include <string.h>
 
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "devices/timer.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Sectors held by one page of cache memory. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Number of sectors allocated by buffer_init (). */
+#define CACHE_INIT_SIZE 64
 
+/* Most consecutive sectors the cache moves with one multi-sector
+   transfer, through a bounce buffer of this many sectors. */
+#define CACHE_RUN_MAX 16
+
+/* A transfer of a run of consecutive cached sectors, submitted to
+   the request queue of their device.  A run of more than one
+   sector goes through the bounce buffer DATA. */
+struct cache_io
+  {
+    struct block_request request;
+    struct semaphore *done;             /* Up'd when a write ends. */
+    size_t cnt;                         /* Entries in RUN. */
+    struct sector_cache *run[CACHE_RUN_MAX];
+    uint8_t data[];                     /* CNT sectors if CNT > 1. */
+  };
 
 /* List of open sectors */
 static struct list open_sectors;
 // here we assume the head of list the recent one,
 // the tail of the list is the oldest one
 
+/* Valid sectors indexed by (block, sector_id), so that a lookup
+   does not need to walk open_sectors.  The list only keeps the
+   LRU order. */
+static struct hash sector_table;
+
+/* Protects open_sectors, sector_table, the identity of every
+   entry and the pin counts.  It is never held across block I/O or
+   data copies; those are covered by the per-entry state. */
 struct lock list_revise_lock;
 
-/* pointer to the sector memory */
-struct sector *sector_entry;
+/* Signaled (with list_revise_lock) when an entry becomes unpinned. */
+static struct condition entry_unpinned;
+
+/* Entries that do not hold any sector.  They are used before the
+   replacement policy has to evict anything. */
+static struct list free_sectors;
+
+/* Metadata of every sector, in the order the clock hand visits
+   them.  The cache grows one page of sectors at a time, up to
+   buffer_max_sectors. */
+static struct sector_cache **sector_caches;
+static size_t cache_cnt;
+static size_t clock_hand;
+
+enum buffer_policy buffer_policy = BUFFER_LRU;
+size_t buffer_max_sectors = BUFFER_DEFAULT_SECTORS;
+int64_t buffer_write_behind_ticks = BUFFER_DEFAULT_WRITE_BEHIND;
 
 static int num_access;
 static int num_hits;
 
+/* Totals since boot, for buffer_print_stats (). */
+static long long total_access;
+static long long total_hits;
+static long long total_prefetch;
+
+/* Number of pending read-ahead requests we keep.  Requests that
+   arrive when the queue is full are dropped. */
+#define PREFETCH_QUEUE_SIZE 64
+
+/* A sector to bring into the cache ahead of its first read. */
+struct prefetch_request
+  {
+    struct block *block;
+    block_sector_t sector;
+  };
+
+/* Read-ahead queue, a ring buffer consumed by the read-ahead
+   thread. */
+static struct prefetch_request prefetch_queue[PREFETCH_QUEUE_SIZE];
+static size_t prefetch_head;              /* Next request to serve. */
+static size_t prefetch_cnt;               /* Number of pending requests. */
+static struct lock prefetch_lock;
+static struct condition prefetch_ready;   /* Queue became non-empty. */
+
+static unsigned sector_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool sector_less (const struct hash_elem *a,
+                         const struct hash_elem *b, void *aux UNUSED);
+static bool cache_grow (void);
+static struct sector_cache *cache_lookup (struct block *block,
+                                          block_sector_t sector);
+static struct sector_cache *lru_victim (void);
+static struct sector_cache *clock_victim (void);
+static struct sector_cache *cache_evict (struct block *block,
+                                         block_sector_t sector,
+                                         bool *cached);
+static bool cache_contains (struct block *block, block_sector_t sector);
+static struct sector_cache *cache_get (struct block *block,
+                                       block_sector_t sector, bool load);
+static void cache_fill (struct sector_cache *cache_entry, bool load);
+static void cache_begin (struct sector_cache *cache_entry, bool write);
+static void cache_unpin (struct sector_cache *cache_entry);
+static bool cache_claim (struct sector_cache *cache_entry, bool wait);
+static void cache_write_done (struct sector_cache *cache_entry);
+static void cache_write_back (struct sector_cache *cache_entry);
+static struct sector_cache *cache_find_pinned (struct block *block,
+                                               block_sector_t sector);
+static struct cache_io *cache_io_create (struct sector_cache **run,
+                                         size_t n, bool write,
+                                         void (*complete)
+                                           (struct block_request *));
+static void cache_flush_done (struct block_request *request);
+static void cache_read_done (struct block_request *request);
+static void cache_read_run (struct sector_cache **run, size_t n);
+static void cache_load_run (struct block *block, block_sector_t sector,
+                            size_t cnt);
+static void cache_flush (int64_t dirtied_before);
+static int sector_compare (const void *a, const void *b, void *aux UNUSED);
+static void write_behind (void *aux UNUSED);
+static void read_ahead (void *aux UNUSED);
+
 /* init the buffer system */
 bool
 buffer_init(void)
 {
   // init the sector head list
   list_init (&open_sectors);
-  sector_entry = NULL;
-  // calloc 64 sector space as buffer
-  sector_entry = calloc (64, sizeof *sector_entry);
-  if (sector_entry == NULL) {
+  list_init (&free_sectors);
+  if (!hash_init (&sector_table, sector_hash, sector_less, NULL)) {
     return false;
   }
+  if (buffer_max_sectors < BUFFER_MIN_SECTORS) {
+    buffer_max_sectors = BUFFER_MIN_SECTORS;
+  }
+  // room for the metadata pointers of the largest cache we allow
+  sector_caches = malloc (buffer_max_sectors * sizeof *sector_caches);
+  if (sector_caches == NULL) {
+    return false;
+  }
+  cache_cnt = 0;
+  clock_hand = 0;
+  lock_init (&list_revise_lock);
+  cond_init (&entry_unpinned);
+  num_access = 0;
+  num_hits = 0;
+  total_access = 0;
+  total_hits = 0;
+  total_prefetch = 0;
+  prefetch_head = 0;
+  prefetch_cnt = 0;
+  lock_init (&prefetch_lock);
+  cond_init (&prefetch_ready);
+  // allocate the first pages of sector space as buffer
+  while (cache_cnt < CACHE_INIT_SIZE && cache_grow ())
+    continue;
+  if (cache_cnt == 0) {
+    return false;
+  }
+  if (buffer_write_behind_ticks > 0) {
+    thread_create ("write-behind", PRI_DEFAULT, write_behind, NULL);
+  }
+  thread_create ("read-ahead", PRI_DEFAULT, read_ahead, NULL);
+  return true;
+}
+
+/* Adds one page worth of sectors to the cache, if the cache is
+   below buffer_max_sectors and memory is available.  Returns
+   true if it grew. */
+static bool
+cache_grow (void)
+{
+  struct sector *page;
+  struct sector_cache *cache;
+  int i;
+
+  if (cache_cnt + SECTORS_PER_PAGE > buffer_max_sectors)
+    return false;
+  page = palloc_get_page (0);
+  if (page == NULL)
+    return false;
   // init the meta data 
-  struct sector_cache *cache = NULL;
-  cache = calloc (64, sizeof *cache);
-  int i = 0;
-  struct sector_cache *iter = NULL;
+  cache = calloc (SECTORS_PER_PAGE, sizeof *cache);
   if (cache == NULL) {
-    free (sector_entry);
+    palloc_free_page (page);
     return false;
   }
-  for (i; i < 64; i++) {
-    iter = cache + i;
+  for (i = 0; i < SECTORS_PER_PAGE; i++) {
+    struct sector_cache *iter = cache + i;
     iter->valid = false;
+    iter->accessed = false;
     iter->dirty = false;
-    iter->sector_location = sector_entry + i;
-    list_push_front (&open_sectors, &(iter->cache_elem));
+    iter->dirty_since = 0;
+    iter->pin_cnt = 0;
+    iter->held = false;
+    iter->readers = 0;
+    iter->writing = false;
+    iter->io_busy = false;
+    lock_init (&iter->entry_lock);
+    cond_init (&iter->state_changed);
+    iter->sector_location = page + i;
+    list_push_back (&free_sectors, &(iter->cache_elem));
+    sector_caches[cache_cnt++] = iter;
   }
-  lock_init (&list_revise_lock);
-  num_access = 0;
-  num_hits = 0;
   return true;
 }
 
-/* write back all the dirty sectors */
-void 
-buffer_update_disk ()
+/* Hashes a sector cache entry by its device and sector number. */
+static unsigned
+sector_hash (const struct hash_elem *e, void *aux UNUSED)
 {
+  const struct sector_cache *c = hash_entry (e, struct sector_cache,
+                                             hash_elem);
+  return hash_bytes (&c->sector_id, sizeof c->sector_id)
+         ^ hash_bytes (&c->block_id, sizeof c->block_id);
+}
+
+/* Orders sector cache entries by device, then sector number. */
+static bool
+sector_less (const struct hash_elem *a, const struct hash_elem *b,
+             void *aux UNUSED)
+{
+  const struct sector_cache *ca = hash_entry (a, struct sector_cache,
+                                              hash_elem);
+  const struct sector_cache *cb = hash_entry (b, struct sector_cache,
+                                              hash_elem);
+  if (ca->block_id != cb->block_id)
+    return ca->block_id < cb->block_id;
+  return ca->sector_id < cb->sector_id;
+}
+
+/* Returns the valid cache entry holding SECTOR of BLOCK, or a
+   null pointer if it is not cached.  Under LRU a hit is moved to
+   the head of the list, under clock it only gets its accessed
+   bit set.  Must be called with list_revise_lock held. */
+static struct sector_cache *
+cache_lookup (struct block *block, block_sector_t sector)
+{
+  struct sector_cache key;
+  struct hash_elem *e;
+
+  key.block_id = block;
+  key.sector_id = sector;
+  e = hash_find (&sector_table, &key.hash_elem);
+  if (e == NULL)
+    return NULL;
+
+  struct sector_cache *cache_entry = hash_entry (e, struct sector_cache,
+                                                 hash_elem);
+  if (buffer_policy == BUFFER_CLOCK) {
+    cache_entry->accessed = true;
+  } else {
+    // put the sector to the head of the list
+    list_remove (&cache_entry->cache_elem);
+    list_push_front (&open_sectors, &cache_entry->cache_elem);
+  }
+  return cache_entry;
+}
+
+/* Returns the least recently used unpinned clean entry, or the
+   least recently used unpinned dirty one if there is no clean
+   one, so that a miss rarely waits for a write back.  Returns a
+   null pointer if every entry is pinned. */
+static struct sector_cache *
+lru_victim (void)
+{
+  struct sector_cache *dirty_victim = NULL;
   struct list_elem *e;
+
+  for (e = list_rbegin (&open_sectors); e != list_rend (&open_sectors);
+       e = list_prev (e))
+    {
+      struct sector_cache *c = list_entry (e, struct sector_cache,
+                                           cache_elem);
+      if (c->pin_cnt > 0)
+        continue;
+      if (!c->dirty)
+        return c;
+      if (dirty_victim == NULL)
+        dirty_victim = c;
+    }
+  return dirty_victim;
+}
+
+/* Advances the clock hand to the first unpinned clean entry whose
+   accessed bit is clear, clearing the bits it passes over.  If
+   there is none, returns the first unpinned dirty entry found
+   with a clear accessed bit.  Returns a null pointer if every
+   entry is pinned. */
+static struct sector_cache *
+clock_victim (void)
+{
+  struct sector_cache *dirty_victim = NULL;
+  size_t i;
+
+  // two turns are enough: the first clears every accessed bit
+  for (i = 0; i < 2 * cache_cnt; i++) {
+    struct sector_cache *c = sector_caches[clock_hand];
+    clock_hand = (clock_hand + 1) % cache_cnt;
+    if (c->pin_cnt > 0 || !c->valid)
+      continue;
+    if (c->accessed) {
+      c->accessed = false;
+      continue;
+    }
+    if (!c->dirty)
+      return c;
+    if (dirty_victim == NULL)
+      dirty_victim = c;
+  }
+  return dirty_victim;
+}
+
+/* Takes a free entry, growing the cache if it is below its cap,
+   or else an unpinned entry chosen by the replacement policy, and
+   rebinds it to SECTOR of BLOCK.  A dirty victim is written back
+   first, without holding list_revise_lock during the write.  The returned entry
+   is pinned, at the head of the LRU list and marked io_busy; its
+   data is left for the caller to fill.  If another thread brings
+   SECTOR into the cache while list_revise_lock is released, sets
+   *CACHED and returns that entry pinned instead.
+   Must be called with list_revise_lock held. */
+static struct sector_cache *
+cache_evict (struct block *block, block_sector_t sector, bool *cached)
+{
+  struct sector_cache *cache_entry;
+  bool unlocked = false;
+
+  *cached = false;
+  for (;;) {
+    if (unlocked) {
+      cache_entry = cache_lookup (block, sector);
+      if (cache_entry != NULL) {
+        cache_entry->pin_cnt++;
+        *cached = true;
+        return cache_entry;
+      }
+      unlocked = false;
+    }
+    if (list_empty (&free_sectors))
+      cache_grow ();
+    if (!list_empty (&free_sectors)) {
+      cache_entry = list_entry (list_pop_front (&free_sectors),
+                                struct sector_cache, cache_elem);
+      list_push_front (&open_sectors, &cache_entry->cache_elem);
+      break;
+    }
+    if (buffer_policy == BUFFER_CLOCK)
+      cache_entry = clock_victim ();
+    else
+      cache_entry = lru_victim ();
+    if (cache_entry == NULL) {
+      // every entry is in use, wait for one to be released
+      cond_wait (&entry_unpinned, &list_revise_lock);
+      unlocked = true;
+      continue;
+    }
+    if (!cache_entry->valid || !cache_entry->dirty)
+      break;
+
+    // if it's dirty, we write it back under its old identity, so
+    // that a concurrent access to that sector waits for the write
+    // instead of reading stale data from the device
+    cache_entry->pin_cnt++;
+    lock_release (&list_revise_lock);
+    cache_write_back (cache_entry);
+    lock_acquire (&list_revise_lock);
+    cache_unpin (cache_entry);
+    // the victim may have been used again meanwhile, so pick again
+    unlocked = true;
+  }
+
+  if (cache_entry->valid)
+    hash_delete (&sector_table, &cache_entry->hash_elem);
+  cache_entry->valid = true;
+  cache_entry->accessed = true;
+  cache_entry->dirty = false;
+  cache_entry->block_id = block;
+  cache_entry->sector_id = sector;
+  cache_entry->pin_cnt = 1;
+  // nobody else can see the entry until it is in the table, so
+  // the state can be set without its lock
+  cache_entry->io_busy = true;
+  hash_insert (&sector_table, &cache_entry->hash_elem);
+  if (buffer_policy == BUFFER_LRU) {
+    // put the elem to the front of the list
+    list_remove (&cache_entry->cache_elem);
+    list_push_front (&open_sectors, &cache_entry->cache_elem);
+  }
+  return cache_entry;
+}
+
+/* Returns the pinned entry for SECTOR of BLOCK, bringing it into
+   the cache on a miss.  If LOAD is false, a miss does not read the
+   sector from the device, which is only safe when the caller will
+   overwrite the whole sector; the entry is then returned with
+   exclusive access already taken, so that nobody copies out what
+   the frame held before until the caller has overwritten it. */
+static struct sector_cache *
+cache_get (struct block *block, block_sector_t sector, bool load)
+{
+  struct sector_cache *cache_entry;
+  bool cached;
+
+  // since another thread may revise the list and the table,
+  // only the lookup and the replacement happen under this lock
+  lock_acquire (&list_revise_lock);
+  num_access += 1;
+  total_access += 1;
+  cache_entry = cache_lookup (block, sector);
+  if (cache_entry != NULL) {
+    num_hits += 1;
+    total_hits += 1;
+    cache_entry->pin_cnt++;
+    lock_release (&list_revise_lock);
+    if (!load)
+      cache_begin (cache_entry, true);
+    return cache_entry;
+  }
+  cache_entry = cache_evict (block, sector, &cached);
+  lock_release (&list_revise_lock);
+  if (cached) {
+    if (!load)
+      cache_begin (cache_entry, true);
+  } else if (load) {
+    cache_fill (cache_entry, true);
+  } else {
+    // hand the entry to the caller as a writer; the others keep
+    // waiting, now for the writer instead of the load
+    lock_acquire (&cache_entry->entry_lock);
+    cache_entry->io_busy = false;
+    cache_entry->writing = true;
+    lock_release (&cache_entry->entry_lock);
+  }
+  return cache_entry;
+}
+
+/* Finishes a miss on CACHE_ENTRY, as returned by cache_evict ():
+   reads the sector from the device if LOAD is true, then lets the
+   other accesses to this sector, which wait on io_busy, go on. */
+static void
+cache_fill (struct sector_cache *cache_entry, bool load)
+{
+  if (load) {
+    block_read (cache_entry->block_id, cache_entry->sector_id,
+                (void*)(cache_entry->sector_location));
+  }
+  lock_acquire (&cache_entry->entry_lock);
+  cache_entry->io_busy = false;
+  cond_broadcast (&cache_entry->state_changed, &cache_entry->entry_lock);
+  lock_release (&cache_entry->entry_lock);
+}
+
+/* Drops one pin on CACHE_ENTRY.
+   Must be called with list_revise_lock held. */
+static void
+cache_unpin (struct sector_cache *cache_entry)
+{
+  ASSERT (cache_entry->pin_cnt > 0);
+  if (--cache_entry->pin_cnt == 0)
+    cond_signal (&entry_unpinned, &list_revise_lock);
+}
+
+/* Starts writing back CACHE_ENTRY, which the caller has pinned.
+   Returns false if it is not dirty, if the journal holds it, or
+   if WAIT is false and a load or a writer is using it.  Otherwise marks it clean and
+   io_busy, and the caller must write it out and then call
+   cache_write_done (). */
+static bool
+cache_claim (struct sector_cache *cache_entry, bool wait)
+{
+  bool claimed = false;
+
+  lock_acquire (&cache_entry->entry_lock);
+  while (wait && (cache_entry->io_busy || cache_entry->writing))
+    cond_wait (&cache_entry->state_changed, &cache_entry->entry_lock);
+  // held is checked here too: it may have been set since the
+  // caller picked the entry, and the change it guards may be made
+  // while we wait
+  if (cache_entry->dirty && !cache_entry->held
+      && !cache_entry->io_busy && !cache_entry->writing) {
+    cache_entry->io_busy = true;
+    cache_entry->dirty = false;
+    claimed = true;
+  }
+  lock_release (&cache_entry->entry_lock);
+  return claimed;
+}
+
+/* Ends a write back started by cache_claim (). */
+static void
+cache_write_done (struct sector_cache *cache_entry)
+{
+  lock_acquire (&cache_entry->entry_lock);
+  cache_entry->io_busy = false;
+  cond_broadcast (&cache_entry->state_changed, &cache_entry->entry_lock);
+  lock_release (&cache_entry->entry_lock);
+}
+
+/* Writes CACHE_ENTRY back to its device if it is dirty.  The
+   caller must hold a pin on it.  Accesses to the entry wait for
+   the write. */
+static void
+cache_write_back (struct sector_cache *cache_entry)
+{
+  if (cache_claim (cache_entry, true)) {
+    block_write(cache_entry->block_id, cache_entry->sector_id,
+       cache_entry->sector_location);
+    cache_write_done (cache_entry);
+  }
+}
+
+/* Orders two sector cache entries by device, then sector number,
+   for qsort-style sorting. */
+static int
+sector_compare (const void *a, const void *b, void *aux UNUSED)
+{
+  const struct sector_cache *ca = *(struct sector_cache * const *) a;
+  const struct sector_cache *cb = *(struct sector_cache * const *) b;
+  if (ca->block_id != cb->block_id)
+    return ca->block_id < cb->block_id ? -1 : 1;
+  if (ca->sector_id != cb->sector_id)
+    return ca->sector_id < cb->sector_id ? -1 : 1;
+  return 0;
+}
+
+/* Returns a transfer for the N entries of RUN, which hold
+   consecutive sectors, that writes them out if WRITE is true or
+   reads them in otherwise, and calls COMPLETE when it is done.
+   Returns a null pointer if memory is short. */
+static struct cache_io *
+cache_io_create (struct sector_cache **run, size_t n, bool write,
+                 void (*complete) (struct block_request *))
+{
+  struct cache_io *io;
+  size_t k;
+
+  ASSERT (n > 0 && n <= CACHE_RUN_MAX);
+  io = malloc (sizeof *io + (n > 1 ? n * BLOCK_SECTOR_SIZE : 0));
+  if (io == NULL)
+    return NULL;
+  io->done = NULL;
+  io->cnt = n;
+  memcpy (io->run, run, n * sizeof *run);
+  io->request.write = write;
+  io->request.sector = run[0]->sector_id;
+  io->request.cnt = n;
+  io->request.buffer = n > 1 ? (void *) io->data : run[0]->sector_location;
+  io->request.complete = complete;
+  io->request.aux = io;
+  if (write && n > 1)
+    for (k = 0; k < n; k++)
+      memcpy (io->data + k * BLOCK_SECTOR_SIZE, run[k]->sector_location,
+              BLOCK_SECTOR_SIZE);
+  return io;
+}
+
+/* Completion of a write queued by cache_flush (). */
+static void
+cache_flush_done (struct block_request *request)
+{
+  struct cache_io *io = request->aux;
+  size_t k;
+
+  for (k = 0; k < io->cnt; k++)
+    cache_write_done (io->run[k]);
+  sema_up (io->done);
+  free (io);
+}
+
+/* Writes back, in sector order, every entry that became dirty
+   before tick DIRTIED_BEFORE, except those the journal holds.
+   The entries are pinned first, then
+   runs of consecutive sectors are queued to the device as one
+   request each, without holding the list lock, and the flush
+   waits for all of them at the end. */
+static void
+cache_flush (int64_t dirtied_before)
+{
+  struct sector_cache **dirty;
+  struct semaphore done;
+  size_t submitted = 0;
+  size_t cnt = 0;
+  size_t i, k;
   
   lock_acquire (&list_revise_lock);
-  for (e = list_begin (&open_sectors); e != list_end (&open_sectors);
-       e = list_next (e))
+  dirty = malloc (cache_cnt * sizeof *dirty);
+  if (dirty == NULL) {
+    lock_release (&list_revise_lock);
+    PANIC ("no memory to flush the buffer cache");
+  }
+  for (i = 0; i < cache_cnt; i++)
+    {
+      struct sector_cache *cache_entry = sector_caches[i];
+      bool expired;
+      if (!cache_entry->valid || cache_entry->held)
+        continue;
+      lock_acquire (&cache_entry->entry_lock);
+      expired = cache_entry->dirty
+                && cache_entry->dirty_since < dirtied_before;
+      lock_release (&cache_entry->entry_lock);
+      if (expired) {
+        cache_entry->pin_cnt++;
+        dirty[cnt++] = cache_entry;
+      }
+    }
+  lock_release (&list_revise_lock);
+
+  sort (dirty, cnt, sizeof *dirty, sector_compare, NULL);
+  sema_init (&done, 0);
+  for (i = 0; i < cnt; )
     {
-      struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-      if (cache_entry->valid && cache_entry->dirty) {
-        block_write(cache_entry->block_id, cache_entry->sector_id,
-         cache_entry->sector_location);
-        cache_entry->dirty = false;
+      struct sector_cache *first = dirty[i++];
+      struct cache_io *io;
+      size_t n = 1;
+
+      if (!cache_claim (first, true))
+        continue;
+      // take along the sectors right after it, as long as they can
+      // be had without waiting; the others are written on their own
+      while (i < cnt && n < CACHE_RUN_MAX
+             && dirty[i]->block_id == first->block_id
+             && dirty[i]->sector_id == first->sector_id + n
+             && cache_claim (dirty[i], false)) {
+        i++;
+        n++;
+      }
+      io = cache_io_create (&dirty[i - n], n, true, cache_flush_done);
+      if (io != NULL) {
+        io->done = &done;
+        block_submit (first->block_id, &io->request);
+        submitted++;
+      } else {
+        // short of memory: write them right away, one by one
+        for (k = 0; k < n; k++) {
+          block_write (first->block_id, first->sector_id + k,
+                       dirty[i - n + k]->sector_location);
+          cache_write_done (dirty[i - n + k]);
+        }
       }
     }
+  while (submitted-- > 0)
+    sema_down (&done);
+
+  lock_acquire (&list_revise_lock);
+  for (i = 0; i < cnt; i++)
+    cache_unpin (dirty[i]);
   lock_release (&list_revise_lock);
+  free (dirty);
 }
 
-/* Reads sector SECTOR from BLOCK into BUFFER, which must
-   have room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to block devices, so external
-   per-block device locking is unneeded. */
+/* write back all the dirty sectors */
+void 
+buffer_update_disk ()
+{
+  cache_flush (INT64_MAX);
+}
+
+/* Write-behind thread.  Every buffer_write_behind_ticks it writes
+   back the sectors that have been dirty for at least that long,
+   which bounds what a crash can lose and keeps most victims clean
+   by the time a miss needs them. */
+static void
+write_behind (void *aux UNUSED)
+{
+  for (;;) {
+    timer_sleep (buffer_write_behind_ticks);
+    /* Inodes are written into the cache lazily, and metadata
+       changes must be in the log before they can be written in
+       place; committing also brings the free map into the
+       cache. */
+    inode_flush ();
+    journal_commit ();
+    cache_flush (timer_ticks () - buffer_write_behind_ticks + 1);
+  }
+}
+
+/* Queues SECTOR of BLOCK to be read into the cache by the
+   read-ahead thread.  Returns at once; the request is dropped if
+   the queue is full. */
 void
-buffer_read (struct block *block, block_sector_t sector, void *buffer, off_t offset, off_t size)
+buffer_prefetch (struct block *block, block_sector_t sector)
 {
-  // first check whether there is a sector_cache which has the same
-  // block_sector_t, starting from head of the list
-  struct list_elem *e;
-  // since when we iterate the list, another thread may revise its
-  // structure.... so here I only allow one thread to use this list
-  // per time
+  lock_acquire (&prefetch_lock);
+  if (prefetch_cnt < PREFETCH_QUEUE_SIZE) {
+    struct prefetch_request *r =
+      &prefetch_queue[(prefetch_head + prefetch_cnt) % PREFETCH_QUEUE_SIZE];
+    r->block = block;
+    r->sector = sector;
+    prefetch_cnt++;
+    cond_signal (&prefetch_ready, &prefetch_lock);
+  }
+  lock_release (&prefetch_lock);
+}
+
+/* Returns true if SECTOR of BLOCK is cached, without counting an
+   access.  Must be called with list_revise_lock held. */
+static bool
+cache_contains (struct block *block, block_sector_t sector)
+{
+  struct sector_cache key;
+
+  key.block_id = block;
+  key.sector_id = sector;
+  return hash_find (&sector_table, &key.hash_elem) != NULL;
+}
+
+/* Completion of a read queued by cache_read_run (): makes the
+   entries available and unpins them. */
+static void
+cache_read_done (struct block_request *request)
+{
+  struct cache_io *io = request->aux;
+  size_t k;
+
+  for (k = 0; k < io->cnt; k++) {
+    if (io->cnt > 1)
+      memcpy (io->run[k]->sector_location,
+              io->data + k * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+    cache_fill (io->run[k], false);
+  }
   lock_acquire (&list_revise_lock);
-  num_access += 1;
-  bool finished = false;
-  for (e = list_begin (&open_sectors); e != list_end (&open_sectors);
-       e = list_next (e))
-    {
-      struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-      if (cache_entry->valid) {
-        if (cache_entry->sector_id == sector && 
-          cache_entry->block_id == block) {
-          // we find a match
-          char *entry_point = (char *) (cache_entry->sector_location) + offset;
-          memcpy (buffer, entry_point, size);
-          // put the sector to the head of the list
-          list_remove (e);
-          list_push_front (&open_sectors, e);
-          finished = true;
-          num_hits += 1;
-          break;
-        }
+  for (k = 0; k < io->cnt; k++)
+    cache_unpin (io->run[k]);
+  lock_release (&list_revise_lock);
+  free (io);
+}
+
+/* Queues one read of the N entries of RUN, which cache_evict ()
+   returned for consecutive sectors, and returns without waiting
+   for it.  Accesses to those sectors wait on io_busy until the
+   read is done. */
+static void
+cache_read_run (struct sector_cache **run, size_t n)
+{
+  struct cache_io *io;
+  size_t k;
+
+  if (n == 0)
+    return;
+  io = cache_io_create (run, n, false, cache_read_done);
+  if (io != NULL) {
+    block_submit (run[0]->block_id, &io->request);
+    return;
+  }
+
+  // short of memory: read them right away, one by one
+  for (k = 0; k < n; k++)
+    cache_fill (run[k], true);
+  lock_acquire (&list_revise_lock);
+  for (k = 0; k < n; k++)
+    cache_unpin (run[k]);
+  lock_release (&list_revise_lock);
+}
+
+/* Starts bringing the CNT sectors starting at SECTOR of BLOCK
+   into the cache, queueing one read for each run of missing
+   sectors.  CNT is at most CACHE_RUN_MAX.  These loads are not
+   counted as cache accesses, so a later read of such a sector
+   shows up as a hit. */
+static void
+cache_load_run (struct block *block, block_sector_t sector, size_t cnt)
+{
+  struct sector_cache *run[CACHE_RUN_MAX];
+  size_t n = 0, i;
+
+  ASSERT (cnt <= CACHE_RUN_MAX);
+  for (i = 0; i < cnt; i++) {
+    struct sector_cache *cache_entry = NULL;
+    bool cached;
+
+    lock_acquire (&list_revise_lock);
+    if (!cache_contains (block, sector + i)) {
+      cache_entry = cache_evict (block, sector + i, &cached);
+      if (cached) {
+        cache_unpin (cache_entry);
+        cache_entry = NULL;
       } else {
-        // if we meet a invalid one, means we have serached 
-        // to the end of valid sector
-        break; 
+        // not referenced yet, so clock may take it back first
+        cache_entry->accessed = false;
+        total_prefetch += 1;
       }
     }
-  if (!finished) {
-    // need to read from the real device and insert to the responding block
-    if (e == list_end (&open_sectors)) {
-      e = list_pop_back (&open_sectors);
+    lock_release (&list_revise_lock);
+
+    if (cache_entry != NULL) {
+      run[n++] = cache_entry;
     } else {
-      list_remove (e);
+      // a cached sector ends the run
+      cache_read_run (run, n);
+      n = 0;
+    }
+  }
+  cache_read_run (run, n);
+}
+
+/* Read-ahead thread.  Loads queued sectors that are not cached
+   yet, together with the queued requests for the sectors right
+   after them. */
+static void
+read_ahead (void *aux UNUSED)
+{
+  for (;;) {
+    struct prefetch_request r;
+    size_t cnt = 1;
+
+    lock_acquire (&prefetch_lock);
+    while (prefetch_cnt == 0)
+      cond_wait (&prefetch_ready, &prefetch_lock);
+    r = prefetch_queue[prefetch_head];
+    prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+    prefetch_cnt--;
+    while (prefetch_cnt > 0 && cnt < CACHE_RUN_MAX) {
+      struct prefetch_request *next = &prefetch_queue[prefetch_head];
+      if (next->block != r.block || next->sector != r.sector + cnt)
+        break;
+      prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+      prefetch_cnt--;
+      cnt++;
     }
-    struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-    // if it's dirty, we write it back
-    if (cache_entry->dirty && cache_entry->valid) {
-      block_write(cache_entry->block_id, cache_entry->sector_id,
-         cache_entry->sector_location);
+    lock_release (&prefetch_lock);
+
+    cache_load_run (r.block, r.sector, cnt);
+  }
+}
+
+/* Starts bringing the CNT sectors starting at SECTOR of BLOCK into
+   the cache before they are accessed one by one, so that the
+   missing ones are read with a few multi-sector transfers rather
+   than one command per sector.  Does not wait for the reads:
+   accesses to the sectors do. */
+void
+buffer_load (struct block *block, block_sector_t sector, size_t cnt)
+{
+  while (cnt > 0) {
+    size_t n = cnt < CACHE_RUN_MAX ? cnt : CACHE_RUN_MAX;
+    cache_load_run (block, sector, n);
+    sector += n;
+    cnt -= n;
+  }
+}
+
+/* Waits for shared (WRITE false) or exclusive (WRITE true)
+   access to the data of CACHE_ENTRY, which the caller has pinned. */
+static void
+cache_begin (struct sector_cache *cache_entry, bool write)
+{
+  lock_acquire (&cache_entry->entry_lock);
+  if (write) {
+    // exclusive access: wait for loaders, readers and writers
+    while (cache_entry->io_busy || cache_entry->writing
+           || cache_entry->readers > 0)
+      cond_wait (&cache_entry->state_changed, &cache_entry->entry_lock);
+    cache_entry->writing = true;
+  } else {
+    // shared access: wait for a loader or a writer to finish
+    while (cache_entry->io_busy || cache_entry->writing)
+      cond_wait (&cache_entry->state_changed, &cache_entry->entry_lock);
+    cache_entry->readers++;
+  }
+  lock_release (&cache_entry->entry_lock);
+}
+
+/* Returns the cache entry of SECTOR of BLOCK, pinned and with
+   shared access if WRITE is false or exclusive access if WRITE is
+   true.  The sector data can then be used in place through
+   sector_location, without copying it, until buffer_release (). */
+struct sector_cache *
+buffer_acquire (struct block *block, block_sector_t sector, bool write)
+{
+  struct sector_cache *cache_entry = cache_get (block, sector, true);
+  cache_begin (cache_entry, write);
+  return cache_entry;
+}
+
+/* Gives back access to CACHE_ENTRY obtained from buffer_acquire ()
+   with the same WRITE.  Exclusive access marks the sector dirty. */
+void
+buffer_release (struct sector_cache *cache_entry, bool write)
+{
+  lock_acquire (&cache_entry->entry_lock);
+  if (write) {
+    ASSERT (cache_entry->writing);
+    cache_entry->writing = false;
+    if (!cache_entry->dirty) {
+      cache_entry->dirty = true;
+      cache_entry->dirty_since = timer_ticks ();
     }
-    // read the data from device to the sector
-    block_read (block, sector, (void*)(cache_entry->sector_location));
-    cache_entry->valid = true;
-    cache_entry->dirty = false;
-    cache_entry->block_id = block;
-    cache_entry->sector_id = sector;
-    // copy the data to the buffer
-    char *entry_point = (char *) (cache_entry->sector_location) + offset;
-    memcpy (buffer, entry_point, size);
-    // put the elem to the front of the list
-    list_push_front (&open_sectors, e);
+    cond_broadcast (&cache_entry->state_changed, &cache_entry->entry_lock);
+  } else {
+    ASSERT (cache_entry->readers > 0);
+    if (--cache_entry->readers == 0)
+      cond_broadcast (&cache_entry->state_changed, &cache_entry->entry_lock);
   }
+  lock_release (&cache_entry->entry_lock);
+
+  lock_acquire (&list_revise_lock);
+  cache_unpin (cache_entry);
   lock_release (&list_revise_lock);
 }
 
+/* Reads sector SECTOR from BLOCK into BUFFER, which must
+   have room for BLOCK_SECTOR_SIZE bytes.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void
+buffer_read (struct block *block, block_sector_t sector, void *buffer, off_t offset, off_t size)
+{
+  struct sector_cache *cache_entry = buffer_acquire (block, sector, false);
+
+  // copy the data to the buffer
+  char *entry_point = (char *) (cache_entry->sector_location) + offset;
+  memcpy (buffer, entry_point, size);
+
+  buffer_release (cache_entry, false);
+}
+
 /* write the data to the device, the data will start
  * start from the offset of the device's sector, and the size
  * of the data we want to write is size. The data is
@@ -150,65 +936,143 @@ buffer_read (struct block *block, block_sector_t sector, void *buffer, off_t off
 void 
 buffer_write (struct block *block, block_sector_t sector, const void *buffer, off_t offset, off_t size)
 {
-  // first to iterate the list to see whether the block is here
-  struct list_elem *e;
-  // since when we iterate the list, another thread may revise its
-  // structure.... so here I only allow one thread to use this list
-  // per time
+  // a partial write has to keep the rest of the sector, a full
+  // sector write does not need to read it first
+  bool load = offset != 0 || size != BLOCK_SECTOR_SIZE;
+  struct sector_cache *cache_entry = cache_get (block, sector, load);
+  if (load)
+    cache_begin (cache_entry, true);
+
+  // then write the data to this buffer
+  char *entry_point = (char *) (cache_entry->sector_location) + offset;
+  memcpy (entry_point, buffer, size);
+
+  buffer_release (cache_entry, true);
+}
+
+/* Brings SECTOR of BLOCK into the cache and keeps it there until
+   a matching buffer_unpin (), whatever the replacement policy
+   does meanwhile.  Used for index sectors that are read and
+   written back several times in one operation. */
+void
+buffer_pin (struct block *block, block_sector_t sector)
+{
+  cache_get (block, sector, true);
+}
+
+/* Drops a pin taken by buffer_pin (). */
+void
+buffer_unpin (struct block *block, block_sector_t sector)
+{
   lock_acquire (&list_revise_lock);
-  num_access += 1;
-  bool finished = false;
-  for (e = list_begin (&open_sectors); e != list_end (&open_sectors);
-       e = list_next (e))
-    {
-      struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-      if (cache_entry->valid) {
-        if (cache_entry->sector_id == sector && 
-          cache_entry->block_id == block) {
-          char *entry_point = (char *) (cache_entry->sector_location) + offset;
-          memcpy (entry_point, buffer, size);
-          // put the sector to the head of the list
-          list_remove (e);
-          list_push_front (&open_sectors, e);
-          finished = true;
-          cache_entry->valid = true;
-          cache_entry->dirty = true;
-          num_hits += 1;
-          break;
-        }
-      } else {
-        // we have searched to the end of the valid list
-        break;
-      }
-    }
+  cache_unpin (cache_find_pinned (block, sector));
+  lock_release (&list_revise_lock);
+}
 
-  if (!finished) {
-    // printf("write to the disk\n");
-    // need to read from the real device and insert to the responding block
-    if (e == list_end (&open_sectors)) {
-      e = list_pop_back (&open_sectors);
-    } else {
-      list_remove (e);
-    }
-    struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-    // if it's dirty, we write it back
-    if (cache_entry->dirty && cache_entry->valid) {
-      block_write(cache_entry->block_id, cache_entry->sector_id,
-         cache_entry->sector_location);
-    }
+/* Returns the entry for SECTOR of BLOCK, which must be cached and
+   pinned.  Must be called with list_revise_lock held. */
+static struct sector_cache *
+cache_find_pinned (struct block *block, block_sector_t sector)
+{
+  struct sector_cache key;
+  struct hash_elem *e;
 
-    // then write the data to this buffer
-    char *entry_point = (char *) (cache_entry->sector_location) + offset;
-    memcpy (entry_point, buffer, size);
-    cache_entry->valid = true;
-    cache_entry->dirty = true;
-    cache_entry->block_id = block;
-    cache_entry->sector_id = sector;
-    // put the elem to the front of the list
-    list_push_front (&open_sectors, e);
+  key.block_id = block;
+  key.sector_id = sector;
+  e = hash_find (&sector_table, &key.hash_elem);
+  ASSERT (e != NULL);
+  return hash_entry (e, struct sector_cache, hash_elem);
+}
+
+/* Pins SECTOR of BLOCK, which the journal has logged, and keeps
+   cache_flush () from writing it back, until buffer_unhold ().
+   Eviction already skips it for the pin. */
+void
+buffer_hold (struct block *block, block_sector_t sector)
+{
+  struct sector_cache *cache_entry = cache_get (block, sector, true);
+
+  lock_acquire (&list_revise_lock);
+  ASSERT (!cache_entry->held);
+  lock_acquire (&cache_entry->entry_lock);
+  cache_entry->held = true;
+  lock_release (&cache_entry->entry_lock);
+  lock_release (&list_revise_lock);
+}
+
+/* Lets SECTOR of BLOCK be written back again, now that the log
+   holds it. */
+void
+buffer_unhold (struct block *block, block_sector_t sector)
+{
+  struct sector_cache *cache_entry;
+
+  lock_acquire (&list_revise_lock);
+  cache_entry = cache_find_pinned (block, sector);
+  ASSERT (cache_entry->held);
+  lock_acquire (&cache_entry->entry_lock);
+  cache_entry->held = false;
+  lock_release (&cache_entry->entry_lock);
+  cache_unpin (cache_entry);
+  lock_release (&list_revise_lock);
+}
+
+/* Copies the CNT sectors in BUFFER over the cached copies of the
+   CNT sectors starting at SECTOR of BLOCK, for those that are
+   cached, and marks them clean.  For a caller that writes the
+   same data to the device itself: a dirty copy is not written
+   back first, as it is being overwritten anyway. */
+void
+buffer_overwrite (struct block *block, block_sector_t sector, size_t cnt,
+                  const void *buffer)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++) {
+    struct sector_cache *cache_entry;
+
+    lock_acquire (&list_revise_lock);
+    cache_entry = cache_lookup (block, sector + i);
+    if (cache_entry != NULL)
+      cache_entry->pin_cnt++;
+    lock_release (&list_revise_lock);
+    if (cache_entry == NULL)
+      continue;
+
+    // waits for a write back of the old data to finish
+    cache_begin (cache_entry, true);
+    memcpy (cache_entry->sector_location,
+            (const char *) buffer + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+    lock_acquire (&cache_entry->entry_lock);
+    cache_entry->writing = false;
+    cache_entry->dirty = false;
+    cond_broadcast (&cache_entry->state_changed, &cache_entry->entry_lock);
+    lock_release (&cache_entry->entry_lock);
+
+    lock_acquire (&list_revise_lock);
+    cache_unpin (cache_entry);
+    lock_release (&list_revise_lock);
   }
+}
+
+/* Writes SECTOR of BLOCK back at once if it is cached, dirty and
+   not held by the journal. */
+void
+buffer_write_back (struct block *block, block_sector_t sector)
+{
+  struct sector_cache *cache_entry;
+
+  lock_acquire (&list_revise_lock);
+  cache_entry = cache_lookup (block, sector);
+  if (cache_entry == NULL || cache_entry->held) {
+    lock_release (&list_revise_lock);
+    return;
+  }
+  cache_entry->pin_cnt++;
+  lock_release (&list_revise_lock);
+  cache_write_back (cache_entry);
+  lock_acquire (&list_revise_lock);
+  cache_unpin (cache_entry);
   lock_release (&list_revise_lock);
 }
 
@@ -216,10 +1080,22 @@ buffer_write (struct block *block, block_sector_t sector, const void *buffer, of
  * record the hit of our buffer
  */
 void buffer_performance(int *access, int *hit){
+  lock_acquire (&list_revise_lock);
   *access = num_access;
   *hit = num_hits;
   num_access = 0;
   num_hits = 0;
+  lock_release (&list_revise_lock);
+}
+
+/* Prints the hit rate of the cache since boot. */
+void
+buffer_print_stats (void)
+{
+  printf ("Buffer cache (%s, %zu sectors): %lld accesses, %lld hits, "
+          "%lld prefetched\n",
+          buffer_policy == BUFFER_CLOCK ? "clock" : "lru", cache_cnt,
+          total_access, total_hits, total_prefetch);
 }
 
 /* helper function for our test, which
@@ -227,15 +1103,18 @@ void buffer_performance(int *access, int *hit){
  */
 void buffer_clean(void)
 {
-  struct list_elem *e;
+  size_t i;
   buffer_update_disk();
   lock_acquire (&list_revise_lock);
-  for (e = list_begin (&open_sectors); e != list_end (&open_sectors);
-       e = list_next (e))
+  for (i = 0; i < cache_cnt; i++)
     {
-      struct sector_cache *cache_entry = list_entry 
-          (e, struct sector_cache, cache_elem);
-      cache_entry->valid = false;
+      struct sector_cache *cache_entry = sector_caches[i];
+      if (cache_entry->valid && cache_entry->pin_cnt == 0) {
+        hash_delete (&sector_table, &cache_entry->hash_elem);
+        cache_entry->valid = false;
+        list_remove (&cache_entry->cache_elem);
+        list_push_back (&free_sectors, &cache_entry->cache_elem);
+      }
     }
   num_access = 0;
   num_hits = 0;
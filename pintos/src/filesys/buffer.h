@@ -2,6 +2,10 @@
 #define FILESYS_BUFFER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <hash.h>
+#include <list.h>
 #include "filesys/off_t.h"
 #include "threads/synch.h"
 #include "devices/block.h"
@@ -14,21 +18,103 @@ struct sector
 struct sector_cache 
   {
   	struct list_elem cache_elem;			/* list elem to store in the sector cache list */
+    struct hash_elem hash_elem;     /* elem in the (block, sector) lookup table */
   	block_sector_t sector_id;		/* id of the sector */
   	struct block *block_id;			/* id of the device block */
   	struct sector *sector_location; /* location of the sector, which holds data */
     bool valid; 					/* whether this sector is valid */
+    bool accessed;        /* referenced since the clock hand last passed */
+    int pin_cnt;          /* threads using this entry, it can't be evicted while > 0 */
+    bool held;            /* logged by the running journal transaction, so
+                             not written back until buffer_unhold ();
+                             set under entry_lock as well */
+
+    /* Protected by entry_lock instead of the global cache lock. */
+    struct lock entry_lock;         /* lock for the fields below */
+    struct condition state_changed; /* signaled when the entry becomes available */
+    int readers;          /* number of threads copying data out */
+    bool writing;         /* whether a thread is copying data in */
+    bool io_busy;         /* whether the sector is being read or written back */
     bool dirty;						/* whether this sector is dirty */
+    int64_t dirty_since;  /* timer tick at which it became dirty */
   };
 
+/* Replacement policy of the sector cache. */
+enum buffer_policy
+  {
+    BUFFER_LRU,           /* Least recently used, default. */
+    BUFFER_CLOCK          /* Clock (second chance). */
+  };
+
+/* Chosen with kernel command-line option "-cache-policy". */
+extern enum buffer_policy buffer_policy;
+
+/* Default cap on the number of cached sectors. */
+#define BUFFER_DEFAULT_SECTORS 256
+
+/* Range accepted for the cap.  The journal keeps up to 124
+   sectors of a running group held in the cache, and pinned index
+   sectors and in-flight accesses need room besides, so a smaller
+   cache could leave eviction waiting forever.  The upper bound
+   keeps the table of entries allocated by buffer_init () within
+   reason. */
+#define BUFFER_MIN_SECTORS 192
+#define BUFFER_MAX_SECTORS 65536
+
+/* Cap on the number of cached sectors, set with kernel
+   command-line option "-cache", between BUFFER_MIN_SECTORS and
+   BUFFER_MAX_SECTORS.  The cache starts smaller and grows one
+   page of sectors at a time up to this cap. */
+extern size_t buffer_max_sectors;
+
+/* Default write-behind period, in timer ticks. */
+#define BUFFER_DEFAULT_WRITE_BEHIND 500
+
+/* A write-behind thread wakes up every this many timer ticks and
+   writes back the sectors that have been dirty at least that
+   long.  Set with kernel command-line option "-wb"; 0 disables
+   it, leaving write back to eviction and buffer_update_disk (). */
+extern int64_t buffer_write_behind_ticks;
+
 /* Init the buffer system */
 bool buffer_init(void);
 
 /* Read and write */
 void buffer_read (struct block *block, block_sector_t sector, void *buffer, off_t offset, off_t size);
 void buffer_write (struct block *block, block_sector_t sector, const void *buffer, off_t offset, off_t size);
+
+/* In-place access to a cached sector */
+struct sector_cache *buffer_acquire (struct block *block, block_sector_t sector, bool write);
+void buffer_release (struct sector_cache *cache_entry, bool write);
+
 void buffer_update_disk (void);
 void buffer_clean (void);
 
+/* Asynchronous read-ahead */
+void buffer_prefetch (struct block *block, block_sector_t sector);
+
+/* Load a run of consecutive sectors with multi-sector transfers */
+void buffer_load (struct block *block, block_sector_t sector, size_t cnt);
+
+/* Keep a sector resident while it is in use */
+void buffer_pin (struct block *block, block_sector_t sector);
+void buffer_unpin (struct block *block, block_sector_t sector);
+
+/* Keep a sector the journal has logged from reaching its place on
+   disk until the log is committed */
+void buffer_hold (struct block *block, block_sector_t sector);
+void buffer_unhold (struct block *block, block_sector_t sector);
+
+/* Write back one sector now */
+void buffer_write_back (struct block *block, block_sector_t sector);
+
+/* Keep the cache coherent with data written to the device directly */
+void buffer_overwrite (struct block *block, block_sector_t sector,
+                       size_t cnt, const void *buffer);
+
+/* Statistics */
+void buffer_performance (int *access, int *hit);
+void buffer_print_stats (void);
+
 
 #endif /* filesys/file.h */
@@ -0,0 +1,210 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "threads/synch.h"
+
+/* Number of names the cache holds. */
+#define DCACHE_SIZE 256
+
+/* A cached name.  A negative entry records that DIR has no entry
+   called NAME. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentry_table. */
+    struct list_elem lru_elem;          /* Element in dentry_lru. */
+    block_sector_t dir;                 /* Inode sector of the directory. */
+    char name[NAME_MAX + 1];            /* Null terminated name, empty
+                                           if not in dentry_table. */
+    bool present;                       /* False for a negative entry. */
+    bool is_dir;                        /* Names a directory? */
+    block_sector_t sector;              /* Inode sector it names. */
+  };
+
+static struct dentry dentries[DCACHE_SIZE];
+
+/* Cached names by (DIR, NAME), and the same entries, least
+   recently used first.  Entries not in the table are at the
+   front of the list. */
+static struct hash dentry_table;
+static struct list dentry_lru;
+
+/* Bumped by every invalidation.  A lookup that missed only
+   inserts what it found if no invalidation happened while it
+   was reading the directory, so that it cannot cache a name
+   that changed under it. */
+static unsigned generation;
+
+/* Protects everything above. */
+static struct lock dcache_lock;
+
+static unsigned dentry_hash (const struct hash_elem *, void *aux);
+static bool dentry_less (const struct hash_elem *, const struct hash_elem *,
+                         void *aux);
+static struct dentry *find (block_sector_t dir, const char *name);
+static void discard (struct dentry *);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  lock_init (&dcache_lock);
+  list_init (&dentry_lru);
+  if (!hash_init (&dentry_table, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry cache creation failed");
+  for (i = 0; i < DCACHE_SIZE; i++)
+    list_push_back (&dentry_lru, &dentries[i].lru_elem);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   On a hit returns true and sets *EP to the cached entry, whose
+   in_use is false if DIR has no entry called NAME.  Returns
+   false on a miss. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, struct dir_entry *ep)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_back (&dentry_lru, &d->lru_elem);
+      ep->in_use = d->present;
+      ep->is_dir = d->is_dir;
+      ep->inode_sector = d->sector;
+      strlcpy (ep->name, d->name, sizeof ep->name);
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Returns the current generation, to be passed to
+   dcache_insert() after reading the directory. */
+unsigned
+dcache_generation (void)
+{
+  unsigned g;
+
+  lock_acquire (&dcache_lock);
+  g = generation;
+  lock_release (&dcache_lock);
+  return g;
+}
+
+/* Caches E, or a negative entry if E's in_use is false, as what
+   looking up NAME in the directory in sector DIR finds, unless
+   the cache was invalidated after GEN was read.  Recycles
+   the least recently used entry.  An empty NAME, which marks a
+   free entry, is never cached. */
+void
+dcache_insert (unsigned gen, block_sector_t dir, const char *name,
+               const struct dir_entry *e)
+{
+  struct dentry *d;
+
+  if (*name == '\0' || strlen (name) > NAME_MAX)
+    return;
+  lock_acquire (&dcache_lock);
+  if (gen == generation && find (dir, name) == NULL)
+    {
+      d = list_entry (list_front (&dentry_lru), struct dentry, lru_elem);
+      discard (d);
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      d->present = e->in_use;
+      d->is_dir = e->is_dir;
+      d->sector = e->inode_sector;
+      hash_insert (&dentry_table, &d->hash_elem);
+      list_remove (&d->lru_elem);
+      list_push_back (&dentry_lru, &d->lru_elem);
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Forgets NAME in the directory in sector DIR.  Called whenever
+   an entry is added to or removed from a directory. */
+void
+dcache_invalidate (block_sector_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  d = find (dir, name);
+  if (d != NULL)
+    discard (d);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every name in the directory in sector DIR, which is
+   being removed, so that nothing cached outlives it if the
+   sector is reused. */
+void
+dcache_purge (block_sector_t dir)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  for (i = 0; i < DCACHE_SIZE; i++)
+    if (dentries[i].name[0] != '\0' && dentries[i].dir == dir)
+      discard (&dentries[i]);
+  lock_release (&dcache_lock);
+}
+
+/* Returns the entry for NAME in DIR, or a null pointer if it is
+   not cached.  The caller must hold dcache_lock. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (*name == '\0' || strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentry_table, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Takes D out of the table, if it is in it, and moves it to the
+   front of the LRU list to be reused first.  The caller must
+   hold dcache_lock. */
+static void
+discard (struct dentry *d)
+{
+  if (d->name[0] != '\0')
+    {
+      hash_delete (&dentry_table, &d->hash_elem);
+      d->name[0] = '\0';
+    }
+  list_remove (&d->lru_elem);
+  list_push_front (&dentry_lru, &d->lru_elem);
+}
+
+/* Hashes a dentry by its directory and name. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_bytes (&d->dir, sizeof d->dir) ^ hash_string (d->name);
+}
+
+/* Orders dentries by directory, then name. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -0,0 +1,21 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/directory.h"
+
+/* Directory entry cache.  Remembers what looking up a name in a
+   directory found, including that nothing was found, keyed by
+   the directory's inode sector and the name. */
+
+void dcache_init (void);
+bool dcache_lookup (block_sector_t dir, const char *name,
+                    struct dir_entry *);
+unsigned dcache_generation (void);
+void dcache_insert (unsigned generation, block_sector_t dir,
+                    const char *name, const struct dir_entry *);
+void dcache_invalidate (block_sector_t dir, const char *name);
+void dcache_purge (block_sector_t dir);
+
+#endif /* filesys/dcache.h */
@@ -1,18 +1,127 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/buffer.h"
+#include "filesys/dcache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Hashed directories.
+
+   A directory is an array of struct dir_entry.  In the linear
+   format, which is what older file systems contain, an entry may
+   sit in any slot.  In the hashed format the first slot is a
+   header, an unused entry whose inode_sector is DIR_HASH_MAGIC,
+   and the rest is an array of buckets of BUCKET_SLOTS entries.
+   A name lives in the bucket picked by linear hashing on the
+   hash of the name, so creating or finding it reads only that
+   bucket.  The bucket count follows from the file length, and
+   when the bucket a new name needs is full the directory grows
+   by splitting one bucket at a time.
+
+   Either way free slots have in_use false.  A split that fails
+   halfway can leave a copy of a moved entry behind in the bucket
+   it was split from; lookups never search there, and the other
+   readers skip such a copy with entry_live() and reuse its slot.
+
+   Adding, removing and listing entries hold the directory's lock,
+   which lives in its in-memory inode so that every struct dir
+   open on it shares it.  A lookup that the dentry cache answers
+   takes no lock, but opening the inode an entry names holds the
+   lock from the lookup on, so that the entry is not removed and
+   its sector reused before the inode is open.  An operation that
+   locks two directories, which only removing a directory does,
+   locks the parent before the child, so locks are always taken
+   down the tree. */
+#define DIR_HASH_MAGIC 0x48534944
+#define BUCKET_SLOTS 16
+#define BUCKET_BYTES ((off_t) (BUCKET_SLOTS * sizeof (struct dir_entry)))
+#define MAX_BUCKETS 4096
+
+/* Returns the byte offset of bucket B. */
+static off_t
+bucket_ofs (size_t b)
+{
+  return sizeof (struct dir_entry) + b * BUCKET_BYTES;
+}
 
+/* Returns the bucket that holds NAME in a directory with BUCKETS
+   buckets, by linear hashing: buckets below BUCKETS - LOW have
+   been split, so they are addressed with one more hash bit. */
+static size_t
+bucket_of (const char *name, size_t buckets)
+{
+  unsigned h = hash_string (name);
+  size_t low = 1;
+  size_t b;
+
+  while (low * 2 <= buckets)
+    low *= 2;
+  b = h & (low * 2 - 1);
+  if (b >= buckets)
+    b = h & (low - 1);
+  return b;
+}
+
+/* Returns true if E, read at byte offset OFS of a directory with
+   BUCKETS buckets (0 for the linear format), is an entry in use.
+   In a hashed directory that means it is also in the bucket its
+   name hashes to, rather than a copy left behind by a split. */
+static bool
+entry_live (const struct dir_entry *e, off_t ofs, size_t buckets)
+{
+  if (!e->in_use)
+    return false;
+  if (buckets == 0)
+    return true;
+  return ofs >= bucket_ofs (0)
+         && bucket_of (e->name, buckets)
+            == (size_t) ((ofs - bucket_ofs (0)) / BUCKET_BYTES);
+}
+
+/* Returns the number of buckets in directory INODE, or 0 if it
+   is in the linear format. */
+static size_t
+bucket_cnt (struct inode *inode)
+{
+  struct dir_entry h;
+  off_t len = inode_length (inode);
+
+  if (inode_read_at (inode, &h, sizeof h, 0) != sizeof h
+      || h.in_use || h.inode_sector != DIR_HASH_MAGIC)
+    return 0;
+  return (len - sizeof h) / BUCKET_BYTES;
+}
 
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  size_t buckets = DIV_ROUND_UP (entry_cnt, BUCKET_SLOTS);
+  struct dir_entry h;
+  struct inode *inode;
+  bool success;
+
+  if (buckets == 0)
+    buckets = 1;
+  if (!inode_create (sector, bucket_ofs (buckets)))
+    return false;
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  inode_set_metadata (inode);
+  memset (&h, 0, sizeof h);
+  h.inode_sector = DIR_HASH_MAGIC;
+  h.in_use = false;
+  success = inode_write_at (inode, &h, sizeof h, 0) == sizeof h;
+  inode_close (inode);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -23,6 +132,7 @@ dir_open (struct inode *inode)
   struct dir *dir = calloc (1, sizeof *dir);
   if (inode != NULL && dir != NULL)
     {
+      inode_set_metadata (inode);
       dir->inode = inode;
       dir->pos = 0;
       return dir;
@@ -69,33 +179,228 @@ dir_get_inode (struct dir *dir)
   return dir->inode;
 }
 
-/* Searches DIR for a file with the given NAME.
+/* Searches the entries of DIR, which has BUCKETS buckets, at
+   byte offsets START up to END for an entry named NAME, of any
+   kind if ANY_KIND is true, otherwise only a directory if IS_DIR
+   is true or only a file if it is false.  Entries are compared
+   in place in the buffer cache; only an entry that straddles two
+   sectors is copied out, and one in a hole reads as a free slot.
+   If FREEP is non-null, sets *FREEP to the offset of the first
+   free slot passed over, or -1 if there is none; a copy that is
+   not live counts as free.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
    otherwise, returns false and ignores EP and OFSP. */
 static bool
-lookup (const struct dir *dir, const char *name,
-        struct dir_entry *ep, off_t *ofsp) 
+scan_range (const struct dir *dir, size_t buckets, off_t start, off_t end,
+            const char *name, bool any_kind, bool is_dir,
+            struct dir_entry *ep, off_t *ofsp, off_t *freep)
 {
+  static const struct dir_entry hole;
+  struct sector_cache *c = NULL;
+  off_t c_ofs = -1;
   struct dir_entry e;
-  size_t ofs;
-  
+  off_t len;
+  off_t ofs;
+  bool found = false;
+
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (e.in_use && !strcmp (name, e.name)) 
+  if (freep != NULL)
+    *freep = -1;
+  len = inode_length (dir->inode);
+  if (end > len)
+    end = len;
+  for (ofs = start; ofs + (off_t) sizeof e <= end; ofs += sizeof e) {
+    const struct dir_entry *p;
+    off_t sector_ofs = ofs % BLOCK_SECTOR_SIZE;
+    bool live;
+
+    if (sector_ofs + sizeof e <= BLOCK_SECTOR_SIZE) {
+      if (ofs - sector_ofs != c_ofs) {
+        if (c != NULL)
+          buffer_release (c, false);
+        c_ofs = ofs - sector_ofs;
+        c = inode_acquire_sector (dir->inode, c_ofs);
+      }
+      if (c != NULL)
+        p = (const struct dir_entry *) ((const char *) c->sector_location
+                                        + sector_ofs);
+      else
+        p = &hole;      // a sector never written, all free slots
+    } else {
+      // the entry straddles two sectors
+      if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+        break;
+      p = &e;
+    }
+
+    live = entry_live (p, ofs, buckets);
+    if (!live && freep != NULL && *freep == -1)
+      *freep = ofs;
+    if (live && (any_kind || p->is_dir == is_dir)
+        && !strcmp (name, p->name)) 
       {
         if (ep != NULL)
-          *ep = e;
+          *ep = *p;
         if (ofsp != NULL)
           *ofsp = ofs;
-        return true;
+        found = true;
+        break;
+      }
+  }
+  if (c != NULL)
+    buffer_release (c, false);
+  return found;
+}
+
+/* Searches DIR for an entry named NAME as scan_range() does, in
+   the bucket NAME hashes to if DIR is hashed and in the whole
+   directory otherwise. */
+static bool
+scan_entries (const struct dir *dir, const char *name, bool any_kind,
+              bool is_dir, struct dir_entry *ep, off_t *ofsp, off_t *freep)
+{
+  size_t buckets = bucket_cnt (dir->inode);
+
+  if (buckets == 0)
+    return scan_range (dir, 0, 0, inode_length (dir->inode), name,
+                       any_kind, is_dir, ep, ofsp, freep);
+  else
+    {
+      off_t start = bucket_ofs (bucket_of (name, buckets));
+      return scan_range (dir, buckets, start, start + BUCKET_BYTES, name,
+                         any_kind, is_dir, ep, ofsp, freep);
+    }
+}
+
+/* Adds bucket number BUCKETS to hashed directory DIR, which has
+   BUCKETS buckets, and moves into it the entries of the bucket
+   it was split from that now hash to it.
+   Returns true if successful, false on a disk or memory error. */
+static bool
+split_bucket (struct dir *dir, size_t buckets)
+{
+  struct dir_entry *old, *new;
+  size_t low = 1;
+  size_t from;
+  size_t i, j;
+  bool success = false;
+
+  while (low * 2 <= buckets)
+    low *= 2;
+  from = buckets - low;
+
+  old = malloc (2 * BUCKET_BYTES);
+  if (old == NULL)
+    return false;
+  new = old + BUCKET_SLOTS;
+  memset (new, 0, BUCKET_BYTES);
+  if (inode_read_at (dir->inode, old, BUCKET_BYTES, bucket_ofs (from))
+      != BUCKET_BYTES)
+    goto done;
+  for (i = j = 0; i < BUCKET_SLOTS; i++)
+    if (old[i].in_use && bucket_of (old[i].name, buckets + 1) == buckets)
+      {
+        new[j++] = old[i];
+        old[i].in_use = false;
       }
-  } 
-    
-  return false;
+
+  /* Write the new bucket first.  It counts as soon as the file
+     has grown, so if writing the old bucket then fails, the moved
+     entries are in both buckets; only the copies in the new one
+     are live, and the old ones are skipped and reused. */
+  success = (inode_write_at (dir->inode, new, BUCKET_BYTES,
+                             bucket_ofs (buckets)) == BUCKET_BYTES
+             && (j == 0
+                 || inode_write_at (dir->inode, old, BUCKET_BYTES,
+                                    bucket_ofs (from)) == BUCKET_BYTES));
+ done:
+  free (old);
+  return success;
+}
+
+/* Sets *EP to the entry named NAME in DIR, of any kind, or
+   marks it not in use if there is none, answering from the
+   dentry cache when it can and filling it when it cannot.  If
+   LOCKED is false, takes DIR's lock for the scan, so that a
+   bucket being split does not hide the name; otherwise the
+   caller holds it. */
+static void
+cached_entry (const struct dir *dir, const char *name, bool locked,
+              struct dir_entry *ep)
+{
+  block_sector_t sector = inode_get_inumber (dir->inode);
+  struct lock *lock = inode_dir_lock (dir->inode);
+  unsigned gen;
+
+  if (dcache_lookup (sector, name, ep))
+    return;
+  gen = dcache_generation ();
+  if (!locked)
+    lock_acquire (lock);
+  if (!scan_entries (dir, name, true, false, ep, NULL, NULL))
+    ep->in_use = false;
+  if (!locked)
+    lock_release (lock);
+  dcache_insert (gen, sector, name, ep);
+}
+
+/* Searches DIR for an entry named NAME as scan_entries() does,
+   through the dentry cache. */
+static bool
+cached_lookup (const struct dir *dir, const char *name, bool any_kind,
+               bool is_dir, struct dir_entry *ep)
+{
+  struct dir_entry e;
+
+  cached_entry (dir, name, false, &e);
+  if (!e.in_use || !(any_kind || e.is_dir == is_dir))
+    return false;
+  if (ep != NULL)
+    *ep = e;
+  return true;
+}
+
+/* Opens and returns the inode of the entry named NAME in DIR, of
+   any kind if ANY_KIND is true, otherwise only a directory if
+   IS_DIR is true or only a file if it is false.  Returns a null
+   pointer if there is no such entry or DIR has been removed.
+   DIR's lock is held from the lookup until the inode is open, so
+   the entry cannot be removed, and its sector reused, in between;
+   the dentry cache only saves the scan. */
+static struct inode *
+open_entry (const struct dir *dir, const char *name, bool any_kind,
+            bool is_dir)
+{
+  struct lock *lock = inode_dir_lock (dir->inode);
+  struct inode *inode = NULL;
+  struct dir_entry e;
+
+  lock_acquire (lock);
+  if (!inode_is_removed (dir->inode))
+    {
+      cached_entry (dir, name, true, &e);
+      if (e.in_use && (any_kind || e.is_dir == is_dir))
+        inode = inode_open (e.inode_sector);
+    }
+  lock_release (lock);
+  return inode;
+}
+
+/* Searches DIR for a file with the given NAME.
+   If successful, returns true, sets *EP to the directory entry
+   if EP is non-null, and sets *OFSP to the byte offset of the
+   directory entry if OFSP is non-null.
+   otherwise, returns false and ignores EP and OFSP. */
+static bool
+lookup (const struct dir *dir, const char *name,
+        struct dir_entry *ep, off_t *ofsp) 
+{
+  if (ofsp == NULL)
+    return cached_lookup (dir, name, true, false, ep);
+  return scan_entries (dir, name, true, false, ep, ofsp, NULL);
 }
 
 /* Searches DIR for a file with the given NAME
@@ -106,19 +411,10 @@ bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
-  struct dir_entry e;
-
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else {
-    // printf(" inside dir_lookup, fail\n");
-    *inode = NULL;
-  }
-    
-
+  *inode = open_entry (dir, name, true, false);
   return *inode != NULL;
 }
 
@@ -129,18 +425,10 @@ bool
 dir_lookup_files (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
-  struct dir_entry e;
-
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (entry_lookup (dir, name, &e, NULL, false))
-    *inode = inode_open (e.inode_sector);
-  else {
-    *inode = NULL;
-  }
-    
-
+  *inode = open_entry (dir, name, false, false);
   return *inode != NULL;
 }
 
@@ -150,28 +438,25 @@ bool
 entry_lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp, bool is_dir) 
 {
-  struct dir_entry e;
-  size_t ofs;
-  
-  ASSERT (dir != NULL);
-  ASSERT (name != NULL);
+  if (ofsp == NULL)
+    return cached_lookup (dir, name, false, is_dir, ep);
+  return scan_entries (dir, name, false, is_dir, ep, ofsp, NULL);
+}
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (e.is_dir != is_dir)
-      continue;
+/* Opens and returns the inode of the directory named NAME in the
+   directory whose inode is PARENT, which the caller keeps open
+   meanwhile.  Returns a null pointer if there is none.  Saves
+   the caller from opening a struct dir for every directory on a
+   path. */
+struct inode *
+dir_open_subdir (struct inode *parent, const char *name)
+{
+  struct dir dir;
 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
-  } 
-    
-  return false;
+  dir.inode = parent;
+  dir.pos = 0;
+  dir.is_remove = false;
+  return open_entry (&dir, name, false, true);
 }
 
 /* Adds a file named NAME to DIR, which must not already contain a
@@ -187,6 +472,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 }
 
 /* Function to add a dir, whose name is name under the dir.
+   Fails if DIR has been removed.
  */ 
 bool
 dir_add_directory (struct dir *dir, const char *name,
@@ -203,71 +489,96 @@ dir_add_directory (struct dir *dir, const char *name,
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  /* Check that NAME is not in use. */
-  if (lookup (dir, name, NULL, NULL))
+  lock_acquire (inode_dir_lock (dir->inode));
+  if (inode_is_removed (dir->inode))
     goto done;
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-     
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (!e.in_use)
-      break;
+  /* Check that NAME is not in use, noting the first free slot
+     on the way.  In a hashed directory split buckets until the
+     one NAME belongs in has room.  In a linear one with no free
+     slot, append at the current end-of-file. */
+  for (;;)
+    {
+      size_t buckets = bucket_cnt (dir->inode);
+
+      if (scan_entries (dir, name, true, false, NULL, NULL, &ofs))
+        goto done;
+      if (ofs != -1)
+        break;
+      if (buckets == 0)
+        {
+          ofs = inode_length (dir->inode);
+          break;
+        }
+      if (buckets >= MAX_BUCKETS || !split_bucket (dir, buckets))
+        goto done;
+    }
 
   /* Write slot. */
+  memset (&e, 0, sizeof e);
   e.in_use = true;
   e.is_dir = is_dir;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
 
  done:
+  lock_release (inode_dir_lock (dir->inode));
   return success;
 }
 
 /* Removes any entry for NAME in DIR.
-   Returns true if successful, false on failure,
-   which occurs only if there is no file with the given NAME. */
+   Returns true if successful, false on failure, which occurs if
+   there is no file with the given NAME, if NAME is a directory
+   that is not empty, or if NAME is "." or "..". */
 bool
 dir_remove (struct dir *dir, const char *name) 
 {
   struct dir_entry e;
   struct inode *inode = NULL;
+  bool child_locked = false;
   bool success = false;
   off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
+  // "." and ".." name the directory itself and its parent, which
+  // would break the locking order
+  if (!strcmp (name, ".") || !strcmp (name, ".."))
+    return false;
+  lock_acquire (inode_dir_lock (dir->inode));
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
-  // check if it's a dir and empty
-  if (e.is_dir && (dir_sizeof(&e) != 0)) {
+
+  /* Open inode. */
+  inode = inode_open (e.inode_sector);
+  if (inode == NULL)
     goto done;
-  }
 
   if (e.is_dir) {
+    // lock the child after the parent, so that nothing is added
+    // to it between checking that it is empty and removing it
+    lock_acquire (inode_dir_lock (inode));
+    child_locked = true;
+    if (dir_sizeof (&e) != 0)
+      goto done;
     // need to consider whether we are delete the current dir
     struct dir *cur_dir = filesys_curr_dir ();
     if (inode_get_inumber (cur_dir->inode) == e.inode_sector) {
       cur_dir->is_remove = true;
     }
   }
-  /* Open inode. */
-  inode = inode_open (e.inode_sector);
-  if (inode == NULL)
-    goto done;
 
   /* Erase directory entry. */
   e.in_use = false;
 
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+  if (e.is_dir)
+    dcache_purge (e.inode_sector);
 
   /* Remove inode. */
   inode_remove (inode);
@@ -276,6 +587,9 @@ dir_remove (struct dir *dir, const char *name)
   success = true;
 
  done:
+  if (child_locked)
+    lock_release (inode_dir_lock (inode));
+  lock_release (inode_dir_lock (dir->inode));
   inode_close (inode);
   return success;
 }
@@ -287,17 +601,26 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  size_t buckets;
+  bool found = false;
 
+  lock_acquire (inode_dir_lock (dir->inode));
+  buckets = bucket_cnt (dir->inode);
   while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
     {
+      off_t ofs = dir->pos;
+
       dir->pos += sizeof e;
-      if (e.in_use && strcmp (e.name, ".") && strcmp (e.name, ".."))
+      if (entry_live (&e, ofs, buckets)
+          && strcmp (e.name, ".") && strcmp (e.name, ".."))
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
+          break;
         } 
     }
-  return false;
+  lock_release (inode_dir_lock (dir->inode));
+  return found;
 }
 
 /* return number of files under this directory.
@@ -313,10 +636,11 @@ dir_sizeof (struct dir_entry *dir_entry)
   if (dir_entry == NULL || !(dir_entry->is_dir)
    || !(dir_entry->in_use)) return 0;
   int res = 0;
+  size_t buckets = bucket_cnt (inode);
   for (ofs = 0; inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) {
 
-    if (e.in_use && strcmp (name1, e.name)
+    if (entry_live (&e, ofs, buckets) && strcmp (name1, e.name)
      && strcmp(name2, e.name)) 
       {
 
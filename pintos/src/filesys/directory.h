@@ -54,5 +54,6 @@ bool dir_add_directory (struct dir *dir, const char *name,
 int dir_sizeof (struct dir_entry *dir_entry);
 bool dir_lookup_files (const struct dir *dir, const char *name,
             struct inode **inode);
+struct inode *dir_open_subdir (struct inode *parent, const char *name);
 
 #endif /* filesys/directory.h */
@@ -15,6 +15,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->direct = false;
       return file;
     }
   else
@@ -52,6 +53,16 @@ file_get_inode (struct file *file)
   return file->inode;
 }
 
+/* Makes reads and writes of FILE move whole sectors directly
+   between the caller's buffer and the disk, bypassing the buffer
+   cache.  Meant for large sector-aligned transfers, which would
+   otherwise evict what other processes keep in the cache. */
+void
+file_set_direct (struct file *file)
+{
+  file->direct = true;
+}
+
 /* Reads SIZE bytes from FILE into BUFFER,
    starting at the file's current position.
    Returns the number of bytes actually read,
@@ -60,7 +71,7 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = file_read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -73,6 +84,8 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_read_direct (file->inode, buffer, size, file_ofs);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -86,7 +99,7 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 off_t
 file_write (struct file *file, const void *buffer, off_t size) 
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -102,6 +115,8 @@ off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
                off_t file_ofs) 
 {
+  if (file->direct)
+    return inode_write_direct (file->inode, buffer, size, file_ofs);
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
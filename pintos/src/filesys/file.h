@@ -10,12 +10,14 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    bool direct;                /* Whole sectors bypass the cache? */
   };
 /* Opening and closing files. */
 struct file *file_open (struct inode *);
 struct file *file_reopen (struct file *);
 void file_close (struct file *);
 struct inode *file_get_inode (struct file *);
+void file_set_direct (struct file *);
 
 /* Reading and writing. */
 off_t file_read (struct file *, void *, off_t);
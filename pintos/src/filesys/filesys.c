@@ -8,11 +8,15 @@
 #include "filesys/directory.h"
 
 #include "filesys/buffer.h"
+#include "filesys/dcache.h"
+#include "filesys/journal.h"
 #include "threads/thread.h"
 /* Partition that contains the file system. */
 struct block *fs_device;
 
 static void do_format (void);
+static bool walk_path (struct dir **dirp, const char **namep,
+                       char part[NAME_MAX + 1]);
 
 /* Extracts a file name part from *SRCP into PART, and updates *SRCP so that the
 next call will return the next file name part. Returns 1 if successful, 0 at
@@ -43,6 +47,36 @@ get_next_part (char part[NAME_MAX + 1], const char **srcp) {
   return 1;
 }
 
+/* Follows the directories named by every part of the path at
+   *NAMEP but the last, starting from *DIRP, and leaves the last
+   part in PART.  Each directory on the way is held open only by
+   its inode, until the next one is open, and its lookup goes
+   through the dentry cache; only the directory reached at the
+   end gets a struct dir, which replaces *DIRP.  Returns false if
+   a directory on the way does not exist, in which case *DIRP is
+   left alone. */
+static bool
+walk_path (struct dir **dirp, const char **namep, char part[NAME_MAX + 1])
+{
+  struct inode *inode = inode_reopen (dir_get_inode (*dirp));
+
+  while (get_next_part (part, namep) == 1) {
+    struct inode *next = dir_open_subdir (inode, part);
+
+    inode_close (inode);
+    if (next == NULL)
+      return false;
+    inode = next;
+  }
+  if (inode == dir_get_inode (*dirp)) {
+    inode_close (inode);
+  } else {
+    dir_close (*dirp);
+    *dirp = dir_open (inode);
+  }
+  return true;
+}
+
 bool
 filesys_create_dir (const char *name) {
   block_sector_t inode_sector = 0;
@@ -61,45 +95,31 @@ filesys_create_dir (const char *name) {
 
   char part[NAME_MAX + 1];
   part[0] = 0;
-  struct dir_entry entry;
-  bool success = true;
-  while (get_next_part(part, &name) == 1) {
-    if (entry_lookup(dir, part, &entry, NULL, 1)) {
-      struct inode *inode = inode_open (entry.inode_sector);
-      dir_close (dir);
-      dir = dir_open (inode);
-    } else {
-      success = false;
-      break;
-    }
-  }
+  journal_begin ();
+  bool success = walk_path (&dir, &name, part);
   if (success) {
     success = (dir != NULL
       && free_map_allocate (1, &inode_sector)
-      && inode_create (inode_sector, initial_size)
+      && dir_create (inode_sector,
+                     initial_size / sizeof (struct dir_entry))
       && dir_add_directory (dir, part, inode_sector, true));
   }
   // find the parents inode_sector
-  // write the ../ dir_entry back to the inode
+  // add the .. and . entries to the new dir; they go wherever
+  // the new dir's format puts them
   if (success) {
-    char name1[3];
-    name1[0] = '.'; name1[1] = '.'; name1[2] = 0;
-    char name2[2];
-    name2[0] = '.'; name2[1] = 0;
-    entry.inode_sector = inode_get_inumber(dir->inode);
-    entry.is_dir = true;
-    strlcpy (&(entry.name), name1, strlen (name1) + 1);
-    struct inode *inode = inode_open (inode_sector);
-    inode_write_at(inode, &entry, sizeof (entry), 0);
-    strlcpy (&(entry.name), name2, strlen (name2) + 1);
-    entry.inode_sector = inode_sector;
-    inode_write_at(inode, &entry, sizeof (entry), sizeof (entry));
-    inode_close (inode);
+    struct dir *child = dir_open (inode_open (inode_sector));
+    if (child != NULL) {
+      dir_add_directory (child, "..", inode_get_inumber (dir->inode), true);
+      dir_add_directory (child, ".", inode_sector, true);
+      dir_close (child);
+    }
   }
   
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
   return success;
 }
 
@@ -115,11 +135,14 @@ filesys_init (bool format)
   // init the buffer
   buffer_init();
   inode_init ();
+  dcache_init ();
+  journal_init ();
   free_map_init ();
 
   if (format) 
     do_format ();
 
+  journal_recover ();
   free_map_open ();
 }
 
@@ -128,9 +151,20 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
-  buffer_update_disk ();
+  inode_reclaim ();
+  filesys_sync ();
   free_map_close ();
 }
+
+/* Writes the dirty in-memory inodes into the cache, commits the
+   metadata journal, then writes every dirty cache sector to
+   disk. */
+void
+filesys_sync (void)
+{
+  inode_flush ();
+  journal_sync ();
+}
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
@@ -154,18 +188,8 @@ filesys_create (const char *name, off_t initial_size)
 
   char part[NAME_MAX + 1];
   part[0] = 0;
-  struct dir_entry entry;
-  bool success = true;
-  while (get_next_part(part, &name) == 1) {
-    if (entry_lookup(dir, part, &entry, NULL, 1)) {
-      struct inode *inode = inode_open (entry.inode_sector);
-      dir_close (dir);
-      dir = dir_open (inode);
-    } else {
-      success = false;
-      break;
-    }
-  }
+  journal_begin ();
+  bool success = walk_path (&dir, &name, part);
 
   if (success) {
     success = (dir != NULL
@@ -177,6 +201,7 @@ filesys_create (const char *name, off_t initial_size)
   if (!success && inode_sector != 0) 
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
   // buffer_update_disk ();
   return success;
 }
@@ -206,18 +231,8 @@ filesys_open (const char *name)
     return NULL;
   }
   char part[NAME_MAX + 1];
-  struct dir_entry entry;
-  bool success = true;
-  while (get_next_part(part, &name) == 1) {
-    if (entry_lookup(dir, part, &entry, NULL, 1)) {
-      struct inode *inode = inode_open (entry.inode_sector);
-      dir_close (dir);
-      dir = dir_open (inode);
-    } else {
-      success = false;
-      break;
-    }
-  }
+  part[0] = 0;
+  bool success = walk_path (&dir, &name, part) && part[0] != 0;
   if (success) {
     dir_lookup_files (dir, part, &inode);
   } else {
@@ -247,21 +262,10 @@ filesys_open_directory (const char *name)
     return dir_open_root ();
   }
   char part[NAME_MAX + 1];
-  struct dir_entry entry;
-  bool success = true;
-  while (get_next_part(part, &name) == 1) {
-    if (entry_lookup(dir, part, &entry, NULL, 1)) {
-      struct inode *inode = inode_open (entry.inode_sector);
-      dir_close (dir);
-      dir = dir_open (inode);
-    } else {
-      success = false;
-      break;
-    }
-  }
+  part[0] = 0;
+  bool success = walk_path (&dir, &name, part) && part[0] != 0;
 
-  if (success && entry_lookup(dir, part, &entry, NULL, 1)) {
-    struct inode *inode = inode_open (entry.inode_sector);
+  if (success && (inode = dir_open_subdir (dir_get_inode (dir), part))) {
     dir_close (dir);
     dir = dir_open (inode);
   } else {
@@ -293,23 +297,14 @@ filesys_remove (const char *name)
   }
   char part[NAME_MAX + 1];
   part[0] = 0;
-  struct dir_entry entry;
-  bool success = true;
-  while (get_next_part(part, &name) == 1) {
-    if (entry_lookup(dir, part, &entry, NULL, 1)) {
-      struct inode *inode = inode_open (entry.inode_sector);
-      dir_close (dir);
-      dir = dir_open (inode);
-    } else {
-      success = false;
-      break;
-    }
-  }
+  journal_begin ();
+  bool success = walk_path (&dir, &name, part);
 
   if (success) {
     success = dir != NULL && dir_remove (dir, part);
   }
   dir_close (dir);
+  journal_end ();
   return success;  
 }
 
@@ -318,6 +313,7 @@ static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  journal_create ();
   free_map_create ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
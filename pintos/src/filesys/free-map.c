@@ -1,12 +1,22 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/synch.h"
+
+/* Free map bits held by one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_map;     /* Free map file sectors not yet
+                                        written back, one bit each. */
+static struct lock free_map_lock;    /* Guards both bitmaps. */
+
+static void mark_dirty (block_sector_t, size_t);
 
 /* Initializes the free map. */
 void
@@ -15,40 +25,112 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_map = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                           BITS_PER_SECTOR));
+  if (dirty_map == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available.  The change reaches the free map file
+   on the next free_map_flush(). */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+  block_sector_t sector;
+
+  for (;;) {
+    lock_acquire (&free_map_lock);
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+    if (sector != BITMAP_ERROR){
+      mark_dirty (sector, cnt);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR){
-    *sectorp = sector;
+    lock_release (&free_map_lock);
+    // removed files may still be waiting to give their sectors back
+    if (sector != BITMAP_ERROR || !inode_reclaim ())
+      break;
   }
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates up to CNT consecutive sectors starting exactly at
+   SECTOR, stopping at the first sector in use.
+   Returns the number of sectors allocated, 0 if SECTOR itself is
+   in use. */
+size_t
+free_map_extend (block_sector_t sector, size_t cnt)
+{
+  size_t n = 0;
+
+  lock_acquire (&free_map_lock);
+  while (n < cnt && sector + n < bitmap_size (free_map)
+         && !bitmap_test (free_map, sector + n))
+    n++;
+  if (n > 0)
+    {
+      bitmap_set_multiple (free_map, sector, n, true);
+      mark_dirty (sector, n);
+    }
+  lock_release (&free_map_lock);
+  return n;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
   // printf("inside relase: %d\n", sector);
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Notes that the free map file sectors holding the bits for CNT
+   sectors starting at SECTOR must be written back.  The caller
+   must hold free_map_lock. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  if (cnt > 0)
+    bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Writes the changed sectors of the free map to the free map
+   file, one write per run of consecutive changed sectors.  Called
+   by the journal as part of each commit. */
+void
+free_map_flush (void)
+{
+  size_t start = 0;
+
+  if (free_map_file == NULL)
+    return;
+  lock_acquire (&free_map_lock);
+  while ((start = bitmap_scan (dirty_map, start, 1, true)) != BITMAP_ERROR)
+    {
+      size_t end = start;
+      while (end < bitmap_size (dirty_map) && bitmap_test (dirty_map, end))
+        end++;
+      bitmap_set_multiple (dirty_map, start, end - start, false);
+      if (!bitmap_write_range (free_map, free_map_file,
+                               start * BITS_PER_SECTOR,
+                               (end - start) * BITS_PER_SECTOR))
+        PANIC ("can't write free map");
+      start = end;
+    }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,15 +140,19 @@ free_map_open (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (free_map_file));
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (dirty_map, false);
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -83,7 +169,9 @@ free_map_create (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
+  inode_set_metadata (file_get_inode (free_map_file));
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
   // printf("finish free_map_create\n");
 }
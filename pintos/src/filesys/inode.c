@@ -1,31 +1,129 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
+#include "filesys/range-lock.h"
 #include "threads/malloc.h"
 #include "filesys/buffer.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
+/* Identifies an inode that maps its data with extents. */
+#define EXTENT_MAGIC 0x494e4f45
+
+/* Most sectors queued for read-ahead by one read. */
+#define READ_AHEAD_MAX 16
 
 #define DIR_LEN 123
 #define MAX_LEN ((123 + 2 * BLOCK_SECTOR_SIZE / 4 + BLOCK_SECTOR_SIZE / 4 * BLOCK_SECTOR_SIZE / 4) * BLOCK_SECTOR_SIZE)
 
+/* Index entries held by one index sector. */
+#define INDEX_CNT (BLOCK_SECTOR_SIZE / 4)
+
+/* What the index of an INODE_MAGIC inode holds for a sector, or
+   an index sector, that has never been written: a hole, which
+   reads as zeros.  Sector 0 holds the free map, so it never is
+   file data. */
+#define HOLE_SECTOR 0
+
+/* Set in an index entry for a data sector that inode_create ()
+   reserved but nobody has written yet.  It reads as zeros, like a
+   hole, and is zeroed in the cache by the first write. */
+#define UNWRITTEN 0x80000000u
+
+/* Most closed inodes kept in memory for a quick reopen. */
+#define CLOSED_INODE_MAX 32
+
+/* Most dirty inodes inode_flush () takes out of the inode table
+   at a time. */
+#define FLUSH_BATCH 16
+
+/* Sectors that fit in a page, the most extent_grow () zeroes
+   with one device write. */
+#define ZERO_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Pages of kernel memory that a direct transfer to or from a user
+   buffer is staged through, so that the disk can use DMA. */
+#define BOUNCE_PAGES 8
+#define BOUNCE_SECTORS (BOUNCE_PAGES * PGSIZE / BLOCK_SECTOR_SIZE)
+
+static block_sector_t
+byte_to_sector_helper (struct inode *inode, off_t pos, int len);
 static block_sector_t
-byte_to_sector_helper (const struct inode *inode, off_t pos, int len);
+lookup_sector (struct inode *inode, off_t pos, int len);
+
+/* A run of LENGTH consecutive sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;
+    block_sector_t length;
+  };
+
+/* Extents held by the inode itself. */
+#define EXTENT_INLINE 61
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    block_sector_t dir[DIR_LEN];
-    block_sector_t single_indir[2];
-    block_sector_t double_indir;
+    union
+      {
+        /* INODE_MAGIC: one pointer per sector. */
+        struct
+          {
+            block_sector_t dir[DIR_LEN];
+            block_sector_t single_indir[2];
+            block_sector_t double_indir;
+          };
+        /* EXTENT_MAGIC: runs of sectors, in file order. */
+        struct
+          {
+            uint32_t extent_cnt;        /* Extents used in EXTENTS. */
+            block_sector_t extent_root; /* Extent tree root, 0 if none. */
+            block_sector_t extent_sectors; /* Sectors mapped in all. */
+            uint32_t unused;
+            struct extent extents[EXTENT_INLINE];
+          };
+      };
   };
 
+/* Extent tree, used once a file has more than EXTENT_INLINE
+   extents.  The root sector points to up to EXTENT_ROOT_CNT
+   leaves, each of which holds up to EXTENT_LEAF_CNT extents that
+   continue the file where the previous leaf stopped.  Sector 0
+   holds the free map, so it never is a leaf. */
+#define EXTENT_ROOT_CNT 64
+#define EXTENT_LEAF_CNT 63
+
+struct extent_root
+  {
+    struct
+      {
+        block_sector_t first;           /* File sector the leaf starts at. */
+        block_sector_t leaf;            /* Leaf sector, 0 if unused. */
+      }
+    leaves[EXTENT_ROOT_CNT];
+  };
+
+struct extent_leaf
+  {
+    uint32_t cnt;                       /* Extents used. */
+    uint32_t unused;
+    struct extent extents[EXTENT_LEAF_CNT];
+  };
+
+enum inode_format inode_format = INODE_INDEXED;
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -37,79 +135,877 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem hash_elem;         /* Element in inode_table. */
+    struct list_elem lru_elem;          /* Element in closed_inodes
+                                           or reclaim_list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* DATA still being read? */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
-    struct inode_disk data;             /* Inode content. */
-    struct lock extend_lock;
-    struct lock length_lock;
+    bool metadata;                      /* Data logged by the journal? */
+    bool dirty;                         /* DATA changed since written? */
+    struct inode_disk data;             /* Inode content.  DATA.length
+                                           only grows, by the writer
+                                           holding the tail of RANGES,
+                                           and is read without a lock. */
+    struct lock extend_lock;            /* Allocates pointers in DATA. */
+    struct range_lock ranges;           /* Bytes being read or written. */
+    struct lock dir_lock;               /* Held while a directory's
+                                           entries are changed. */
+
+    /* Read-ahead state.  Concurrent readers may race on these, it
+       only makes the prediction worse. */
+    int ra_start;                       /* First sector index of last read. */
+    int ra_end;                         /* Last sector index of last read. */
+    int ra_stride;                      /* Distance between the last reads. */
+    int ra_window;                      /* Sectors to read ahead. */
+    int ra_queued;                      /* Highest sector index queued. */
+
+    /* In-memory copies of the index sectors, loaded on first use
+       and dropped whenever inode_extend_length rewrites them. */
+    struct lock index_lock;             /* Protects the copies below. */
+    block_sector_t *indir_copy[2];      /* Single indirect sectors. */
+    block_sector_t *dindir_copy;        /* Double indirect sector. */
+    block_sector_t **dindir_leaf_copy;  /* Its INDEX_CNT second level
+                                           sectors. */
+    block_sector_t ext_first;           /* File sector EXT_HINT starts at. */
+    struct extent ext_hint;             /* Last extent looked up. */
   };
 
+static void inode_drop_index (struct inode *inode);
+static block_sector_t extent_lookup (struct inode *inode,
+                                     block_sector_t idx);
+static bool extent_grow (struct inode_disk *d, block_sector_t sectors,
+                         bool direct);
+static void extent_release (struct inode_disk *d);
+
+static void inode_read_ahead (struct inode *inode, off_t offset,
+                              off_t size, off_t inode_len);
+static void read_ahead_queue (struct inode *inode, int idx,
+                              off_t inode_len);
+static void inode_load (struct inode *inode, off_t offset, off_t size,
+                        off_t inode_len);
+static bool inode_reserve (block_sector_t sector, off_t length);
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or HOLE_SECTOR if that part of INODE was never
+   written.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
 static block_sector_t
-byte_to_sector (const struct inode *inode, off_t pos) 
+byte_to_sector (struct inode *inode, off_t pos) 
 {
   int len = inode_length (inode);
   return byte_to_sector_helper (inode, pos, len);
 }
 
+/* Returns entry I of index sector INDEX_SECTOR, read in place
+   from the buffer cache. */
+static block_sector_t
+index_lookup (block_sector_t index_sector, int i)
+{
+  struct sector_cache *c = buffer_acquire (fs_device, index_sector, false);
+  block_sector_t res = ((block_sector_t *) c->sector_location)[i];
+  buffer_release (c, false);
+  return res;
+}
+
+/* Returns the in-memory copy of index sector SECTOR kept in *COPY,
+   reading it in first if needed.  Returns NULL if memory is
+   short.  The caller must hold the inode's index_lock. */
+static block_sector_t *
+index_copy (block_sector_t **copy, block_sector_t sector)
+{
+  if (*copy == NULL) {
+    *copy = malloc (BLOCK_SECTOR_SIZE);
+    if (*copy != NULL)
+      buffer_read (fs_device, sector, *copy, 0, BLOCK_SECTOR_SIZE);
+  }
+  return *copy;
+}
+
+/* Returns entry I of INODE's index sector SECTOR, cached in *COPY.
+   Falls back to reading the buffer cache directly if no copy can
+   be made. */
 static block_sector_t
-byte_to_sector_helper (const struct inode *inode, off_t pos, int len) 
+index_entry (struct inode *inode, block_sector_t **copy,
+             block_sector_t sector, int i)
+{
+  block_sector_t *index = index_copy (copy, sector);
+  block_sector_t res = index != NULL ? index[i] : index_lookup (sector, i);
+  lock_release (&inode->index_lock);
+  return res;
+}
+
+/* Returns the sector that holds byte POS of INODE as
+   byte_to_sector () describes, given that INODE is LEN bytes
+   long. */
+static block_sector_t
+byte_to_sector_helper (struct inode *inode, off_t pos, int len) 
+{
+  block_sector_t sector = lookup_sector (inode, pos, len);
+  if (sector != (block_sector_t) -1 && (sector & UNWRITTEN))
+    return HOLE_SECTOR;
+  return sector;
+}
+
+/* Returns INODE's index entry for byte POS, with the UNWRITTEN
+   bit if it has one, or -1 if POS is not below LEN. */
+static block_sector_t
+lookup_sector (struct inode *inode, off_t pos, int len) 
 {
   ASSERT (inode != NULL);
   if (pos < len) {
     int index = pos / BLOCK_SECTOR_SIZE;
+    if (inode->data.magic == EXTENT_MAGIC) {
+      return extent_lookup (inode, index);
+    }
     if (index < DIR_LEN) {
       return inode->data.dir[index];
-    } else if (index < DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
+    }
+    if (index < DIR_LEN + INDEX_CNT) {
+      if (inode->data.single_indir[0] == HOLE_SECTOR)
+        return HOLE_SECTOR;
+    } else if (index < DIR_LEN + 2 * INDEX_CNT) {
+      if (inode->data.single_indir[1] == HOLE_SECTOR)
+        return HOLE_SECTOR;
+    } else if (inode->data.double_indir == HOLE_SECTOR) {
+      return HOLE_SECTOR;
+    }
+    lock_acquire (&inode->index_lock);
+    if (index < DIR_LEN + INDEX_CNT) {
       // 1 level indir case
-      // read from the device
-      block_sector_t *tmp_buf = calloc(1, BLOCK_SECTOR_SIZE);
-      buffer_read (fs_device, inode->data.single_indir[0], tmp_buf, 0, BLOCK_SECTOR_SIZE);
-      block_sector_t res = tmp_buf[index - DIR_LEN];
-      free(tmp_buf);
-      return res;
-
-    } else if (index < DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
+      return index_entry (inode, &inode->indir_copy[0],
+                          inode->data.single_indir[0], index - DIR_LEN);
+    } else if (index < DIR_LEN + 2 * INDEX_CNT) {
       // 2nd 1 level indir case
-      block_sector_t *tmp_buf = calloc(1, BLOCK_SECTOR_SIZE);
-      buffer_read (fs_device, inode->data.single_indir[1], tmp_buf, 0, BLOCK_SECTOR_SIZE);
-      block_sector_t res = tmp_buf[index - DIR_LEN - BLOCK_SECTOR_SIZE / 4];
-      free(tmp_buf);
-      return res;
-
+      return index_entry (inode, &inode->indir_copy[1],
+                          inode->data.single_indir[1],
+                          index - DIR_LEN - INDEX_CNT);
     } else { 
       // read the double indirector pointer
-      block_sector_t *tmp_buf = calloc(1, BLOCK_SECTOR_SIZE);
-      buffer_read (fs_device, inode->data.double_indir, tmp_buf, 0, BLOCK_SECTOR_SIZE);
-      index = index - (DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4);
-      int tmp_index = index / (BLOCK_SECTOR_SIZE / 4);
-      int tmp_index2 = index % (BLOCK_SECTOR_SIZE / 4);
-      block_sector_t id_2level = tmp_buf[tmp_index];
-      buffer_read (fs_device, id_2level, tmp_buf, 0, BLOCK_SECTOR_SIZE);
-      block_sector_t res = tmp_buf[tmp_index2];
-      free(tmp_buf);
-      return res;
+      index = index - (DIR_LEN + 2 * INDEX_CNT);
+      int tmp_index = index / INDEX_CNT;
+      int tmp_index2 = index % INDEX_CNT;
+      block_sector_t *top = index_copy (&inode->dindir_copy,
+                                        inode->data.double_indir);
+      if (top != NULL && inode->dindir_leaf_copy == NULL)
+        inode->dindir_leaf_copy = calloc (INDEX_CNT,
+                                          sizeof *inode->dindir_leaf_copy);
+      if (top == NULL || inode->dindir_leaf_copy == NULL) {
+        lock_release (&inode->index_lock);
+        block_sector_t id_2level = index_lookup (inode->data.double_indir,
+                                                 tmp_index);
+        if (id_2level == HOLE_SECTOR)
+          return HOLE_SECTOR;
+        return index_lookup (id_2level, tmp_index2);
+      }
+      if (top[tmp_index] == HOLE_SECTOR) {
+        lock_release (&inode->index_lock);
+        return HOLE_SECTOR;
+      }
+      return index_entry (inode, &inode->dindir_leaf_copy[tmp_index],
+                          top[tmp_index], tmp_index2);
     }
   } else {
     return -1;    
   }
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Makes *SLOT a sector that can be written.  A hole gets a new
+   sector, and a sector marked UNWRITTEN loses the mark.  Either
+   way the sector is zeroed in the cache before *SLOT changes, so
+   that whoever finds it usable also finds it initialized; only
+   the cache sees those zeros unless nothing else gets written
+   over them.  The running handle writes the sector back before
+   the pointer without the mark is committed, since on disk it
+   still holds whatever a deleted file left there.  If RESERVE is
+   true a hole instead gets a new sector marked UNWRITTEN, and
+   nothing is written.
+   Returns false if the disk is full. */
+static bool
+fill_slot (block_sector_t *slot, bool reserve)
+{
+  static const char zeros[BLOCK_SECTOR_SIZE];
+  block_sector_t sector = *slot & ~UNWRITTEN;
+
+  if (*slot == HOLE_SECTOR) {
+    if (!free_map_allocate (1, &sector))
+      return false;
+    journal_data (sector, !reserve);
+    if (reserve) {
+      *slot = sector | UNWRITTEN;
+      return true;
+    }
+  } else if (reserve || !(*slot & UNWRITTEN)) {
+    return true;
+  } else {
+    journal_data (sector, true);
+  }
+  buffer_write (fs_device, sector, zeros, 0, BLOCK_SECTOR_SIZE);
+  *slot = sector;
+  return true;
+}
+
+/* Calls fill_slot () on SLOT, one of INODE's own pointers, and
+   marks INODE dirty if that changes it. */
+static bool
+fill_inode_slot (struct inode *inode, block_sector_t *slot, bool reserve)
+{
+  block_sector_t old = *slot;
+
+  if (!fill_slot (slot, reserve))
+    return false;
+  if (*slot != old)
+    inode->dirty = true;
+  return true;
+}
+
+/* Writes INODE's disk inode to the buffer cache, for the journal
+   to log if this is inside a handle.  The caller must hold
+   extend_lock, so that no pointer changes during the copy. */
+static void
+inode_write_disk (struct inode *inode)
+{
+  inode->dirty = false;
+  journal_write (inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes INODE's disk inode to the buffer cache if it is dirty,
+   taking extend_lock for it. */
+static void
+inode_write_back (struct inode *inode)
+{
+  lock_acquire (&inode->extend_lock);
+  if (inode->dirty)
+    inode_write_disk (inode);
+  lock_release (&inode->extend_lock);
+}
+
+/* Returns entry I of INODE's index sector SECTOR, cached in *COPY
+   if COPY is non-null, after passing it through fill_slot () with
+   RESERVE.  Returns HOLE_SECTOR if the disk is full. */
+static block_sector_t
+index_fill (struct inode *inode, block_sector_t **copy,
+            block_sector_t sector, int i, bool reserve)
+{
+  block_sector_t *index;
+  block_sector_t res;
+
+  lock_acquire (&inode->index_lock);
+  index = copy != NULL ? index_copy (copy, sector) : NULL;
+  res = index != NULL ? index[i] : index_lookup (sector, i);
+  if ((res == HOLE_SECTOR || (!reserve && (res & UNWRITTEN)))
+      && fill_slot (&res, reserve)) {
+    journal_write (sector, &res, i * sizeof res, sizeof res);
+    if (index != NULL)
+      index[i] = res;
+  }
+  lock_release (&inode->index_lock);
+  return res;
+}
+
+/* Returns the sector that holds byte POS of INODE, an INODE_MAGIC
+   inode, after making it writable with fill_slot () and RESERVE,
+   and allocating any index sector on the way that is a hole.
+   Returns HOLE_SECTOR if the disk is full.  The caller must hold
+   extend_lock, which keeps writers from allocating the same hole
+   twice. */
+static block_sector_t
+sector_for_write (struct inode *inode, off_t pos, bool reserve)
+{
+  struct inode_disk *d = &inode->data;
+  int index = pos / BLOCK_SECTOR_SIZE;
+  int k;
+
+  if (index < DIR_LEN)
+    return (fill_inode_slot (inode, &d->dir[index], reserve)
+            ? d->dir[index] : HOLE_SECTOR);
+  index -= DIR_LEN;
+  for (k = 0; k < 2; k++, index -= INDEX_CNT)
+    if (index < INDEX_CNT) {
+      if (!fill_inode_slot (inode, &d->single_indir[k], false))
+        return HOLE_SECTOR;
+      return index_fill (inode, &inode->indir_copy[k], d->single_indir[k],
+                         index, reserve);
+    }
+
+  // double indirect: the top sector, then one of its leaves
+  {
+    block_sector_t leaf;
+    block_sector_t **leaf_copy = NULL;
+
+    if (!fill_inode_slot (inode, &d->double_indir, false))
+      return HOLE_SECTOR;
+    leaf = index_fill (inode, &inode->dindir_copy, d->double_indir,
+                       index / INDEX_CNT, false);
+    if (leaf == HOLE_SECTOR)
+      return HOLE_SECTOR;
+    lock_acquire (&inode->index_lock);
+    if (inode->dindir_leaf_copy == NULL)
+      inode->dindir_leaf_copy = calloc (INDEX_CNT,
+                                        sizeof *inode->dindir_leaf_copy);
+    if (inode->dindir_leaf_copy != NULL)
+      leaf_copy = &inode->dindir_leaf_copy[index / INDEX_CNT];
+    lock_release (&inode->index_lock);
+    return index_fill (inode, leaf_copy, leaf, index % INDEX_CNT, reserve);
+  }
+}
+
+/* Consecutive sectors that are about to be freed together. */
+struct release_run
+  {
+    block_sector_t start;               /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+  };
+
+/* Frees the sectors in RUN and empties it. */
+static void
+release_flush (struct release_run *run)
+{
+  if (run->cnt > 0)
+    free_map_release (run->start, run->cnt);
+  run->cnt = 0;
+}
+
+/* Adds SECTOR to the sectors RUN frees, first freeing those in
+   RUN if SECTOR does not come right after them. */
+static void
+release_sector (struct release_run *run, block_sector_t sector)
+{
+  if (run->cnt > 0 && sector == run->start + run->cnt) {
+    run->cnt++;
+    return;
+  }
+  release_flush (run);
+  run->start = sector;
+  run->cnt = 1;
+}
+
+/* Frees SECTOR, unless it is a hole, and if DEPTH > 0 every
+   sector that it indexes, recursively, DEPTH levels down, adding
+   them to RUN.  An index sector is usually allocated right before
+   the data it points to, so it goes first. */
+static void
+release_index (struct release_run *run, block_sector_t sector, int depth)
+{
+  sector &= ~UNWRITTEN;
+  if (sector == HOLE_SECTOR)
+    return;
+  release_sector (run, sector);
+  if (depth > 0) {
+    block_sector_t *index = malloc (BLOCK_SECTOR_SIZE);
+    int i;
+
+    if (index != NULL) {
+      buffer_read (fs_device, sector, index, 0, BLOCK_SECTOR_SIZE);
+      for (i = 0; i < INDEX_CNT; i++)
+        release_index (run, index[i], depth - 1);
+      free (index);
+    }
+  }
+}
+
+/* Frees every data and index sector of INODE_MAGIC inode D and
+   makes it all holes.  Consecutive sectors are freed with one
+   free_map_release (). */
+static void
+release_data (struct inode_disk *d)
+{
+  struct release_run run = { 0, 0 };
+  int i;
+
+  for (i = 0; i < DIR_LEN; i++)
+    release_index (&run, d->dir[i], 0);
+  release_index (&run, d->single_indir[0], 1);
+  release_index (&run, d->single_indir[1], 1);
+  release_index (&run, d->double_indir, 2);
+  release_flush (&run);
+  memset (d->dir, 0, sizeof d->dir);
+  memset (d->single_indir, 0, sizeof d->single_indir);
+  d->double_indir = HOLE_SECTOR;
+}
+
+/* Frees INODE's in-memory index copies, so that the next lookup
+   reads them again from the buffer cache. */
+static void
+inode_drop_index (struct inode *inode)
+{
+  int i;
+
+  lock_acquire (&inode->index_lock);
+  free (inode->indir_copy[0]);
+  free (inode->indir_copy[1]);
+  free (inode->dindir_copy);
+  inode->indir_copy[0] = inode->indir_copy[1] = inode->dindir_copy = NULL;
+  if (inode->dindir_leaf_copy != NULL) {
+    for (i = 0; i < INDEX_CNT; i++)
+      free (inode->dindir_leaf_copy[i]);
+    free (inode->dindir_leaf_copy);
+    inode->dindir_leaf_copy = NULL;
+  }
+  lock_release (&inode->index_lock);
+}
+
+/* Returns the sector that holds file sector IDX of extent inode
+   INODE, or -1 if no extent maps it.  Remembers the extent it
+   found, since the next lookup is most likely in the same one.
+   Extents only ever grow at the end of the file, so a remembered
+   extent stays valid. */
+static block_sector_t
+extent_lookup (struct inode *inode, block_sector_t idx)
+{
+  struct inode_disk *d = &inode->data;
+  struct sector_cache *c;
+  struct extent *e = NULL;
+  block_sector_t first = 0, res = -1;
+  uint32_t i;
+
+  lock_acquire (&inode->index_lock);
+  if (idx - inode->ext_first < inode->ext_hint.length)
+    res = inode->ext_hint.start + (idx - inode->ext_first);
+  lock_release (&inode->index_lock);
+  if (res != (block_sector_t) -1)
+    return res;
+
+  for (i = 0; i < d->extent_cnt; first += d->extents[i++].length) {
+    if (idx - first < d->extents[i].length) {
+      e = &d->extents[i];
+      break;
+    }
+  }
+  if (e == NULL && d->extent_root != 0) {
+    struct extent_root *root;
+    struct extent_leaf *leaf;
+    block_sector_t leaf_sector = 0;
+
+    // find the last leaf that starts at or before IDX
+    c = buffer_acquire (fs_device, d->extent_root, false);
+    root = (struct extent_root *) c->sector_location;
+    for (i = 0; i < EXTENT_ROOT_CNT && root->leaves[i].leaf != 0; i++) {
+      if (root->leaves[i].first > idx)
+        break;
+      first = root->leaves[i].first;
+      leaf_sector = root->leaves[i].leaf;
+    }
+    buffer_release (c, false);
+    if (leaf_sector == 0)
+      return -1;
+
+    c = buffer_acquire (fs_device, leaf_sector, false);
+    leaf = (struct extent_leaf *) c->sector_location;
+    for (i = 0; i < leaf->cnt; first += leaf->extents[i++].length) {
+      if (idx - first < leaf->extents[i].length) {
+        res = leaf->extents[i].start + (idx - first);
+        lock_acquire (&inode->index_lock);
+        inode->ext_first = first;
+        inode->ext_hint = leaf->extents[i];
+        lock_release (&inode->index_lock);
+        break;
+      }
+    }
+    buffer_release (c, false);
+    return res;
+  }
+  if (e == NULL)
+    return -1;
+  lock_acquire (&inode->index_lock);
+  inode->ext_first = first;
+  inode->ext_hint = *e;
+  lock_release (&inode->index_lock);
+  return e->start + (idx - first);
+}
+
+/* Stores the last extent of D into *E.  Returns false if D does
+   not have any. */
+static bool
+extent_last (struct inode_disk *d, struct extent *e)
+{
+  struct sector_cache *c;
+  block_sector_t leaf_sector = 0;
+  bool found = false;
+  int i;
+
+  if (d->extent_root == 0) {
+    if (d->extent_cnt == 0)
+      return false;
+    *e = d->extents[d->extent_cnt - 1];
+    return true;
+  }
+  c = buffer_acquire (fs_device, d->extent_root, false);
+  for (i = 0; i < EXTENT_ROOT_CNT; i++) {
+    block_sector_t s = ((struct extent_root *) c->sector_location)
+                         ->leaves[i].leaf;
+    if (s == 0)
+      break;
+    leaf_sector = s;
+  }
+  buffer_release (c, false);
+  if (leaf_sector != 0) {
+    struct extent_leaf *leaf;
+    c = buffer_acquire (fs_device, leaf_sector, false);
+    leaf = (struct extent_leaf *) c->sector_location;
+    if (leaf->cnt > 0) {
+      *e = leaf->extents[leaf->cnt - 1];
+      found = true;
+    }
+    buffer_release (c, false);
+  }
+  return found;
+}
+
+/* Appends the CNT sectors starting at START to the data of D,
+   merging them into the last extent if they continue it.
+   Returns false if the extent tree is full or one of its sectors
+   cannot be allocated. */
+static bool
+extent_append (struct inode_disk *d, block_sector_t start,
+               block_sector_t cnt)
+{
+  struct extent_root *root = NULL;
+  struct extent_leaf *leaf = NULL;
+  block_sector_t root_sector = d->extent_root;
+  block_sector_t leaf_sector = 0;
+  bool success = false;
+  int i = -1;
+
+  if (root_sector == 0) {
+    if (d->extent_cnt > 0) {
+      struct extent *last = &d->extents[d->extent_cnt - 1];
+      if (last->start + last->length == start) {
+        last->length += cnt;
+        return true;
+      }
+    }
+    if (d->extent_cnt < EXTENT_INLINE) {
+      d->extents[d->extent_cnt].start = start;
+      d->extents[d->extent_cnt].length = cnt;
+      // lookups scan the inline extents without a lock
+      barrier ();
+      d->extent_cnt++;
+      return true;
+    }
+  }
+
+  root = calloc (1, sizeof *root);
+  leaf = calloc (1, sizeof *leaf);
+  if (root == NULL || leaf == NULL)
+    goto done;
+  if (root_sector != 0) {
+    buffer_read (fs_device, root_sector, root, 0, BLOCK_SECTOR_SIZE);
+    for (i = 0; i < EXTENT_ROOT_CNT && root->leaves[i].leaf != 0; i++)
+      continue;
+    i--;
+    leaf_sector = root->leaves[i].leaf;
+    buffer_read (fs_device, leaf_sector, leaf, 0, BLOCK_SECTOR_SIZE);
+    if (leaf->cnt > 0) {
+      struct extent *last = &leaf->extents[leaf->cnt - 1];
+      if (last->start + last->length == start) {
+        last->length += cnt;
+        journal_write (leaf_sector, leaf, 0, BLOCK_SECTOR_SIZE);
+        success = true;
+        goto done;
+      }
+    }
+    if (leaf->cnt < EXTENT_LEAF_CNT) {
+      leaf->extents[leaf->cnt].start = start;
+      leaf->extents[leaf->cnt].length = cnt;
+      leaf->cnt++;
+      journal_write (leaf_sector, leaf, 0, BLOCK_SECTOR_SIZE);
+      success = true;
+      goto done;
+    }
+  } else if (!free_map_allocate (1, &root_sector)) {
+    goto done;
+  }
+
+  // start a new leaf
+  if (i + 1 >= EXTENT_ROOT_CNT || !free_map_allocate (1, &leaf_sector)) {
+    if (d->extent_root == 0)
+      free_map_release (root_sector, 1);
+    goto done;
+  }
+  memset (leaf, 0, sizeof *leaf);
+  leaf->cnt = 1;
+  leaf->extents[0].start = start;
+  leaf->extents[0].length = cnt;
+  journal_write (leaf_sector, leaf, 0, BLOCK_SECTOR_SIZE);
+  root->leaves[i + 1].first = d->extent_sectors;
+  root->leaves[i + 1].leaf = leaf_sector;
+  journal_write (root_sector, root, 0, BLOCK_SECTOR_SIZE);
+  d->extent_root = root_sector;
+  success = true;
+
+ done:
+  free (root);
+  free (leaf);
+  return success;
+}
+
+/* Grows extent inode D to map SECTORS sectors and zeroes the new
+   ones.  Continues the last extent in place as far as the free
+   map allows, then takes the longest free runs it can find, so
+   that a file written in one go usually ends up in one extent.
+   The zeros go into the cache, to be written back before the
+   running group commits, unless DIRECT, in which case they are
+   written straight to the device a page at a time.  Returns
+   false if the disk or the extent tree is full. */
+static bool
+extent_grow (struct inode_disk *d, block_sector_t sectors, bool direct)
+{
+  char *zeros;
+  struct extent last;
+  block_sector_t end = 0;
+  bool success = true;
+
+  if (direct)
+    zeros = palloc_get_page (PAL_ZERO);
+  else
+    zeros = calloc (1, BLOCK_SECTOR_SIZE);
+  if (zeros == NULL)
+    return false;
+  if (extent_last (d, &last))
+    end = last.start + last.length;
+  while (d->extent_sectors < sectors) {
+    block_sector_t want = sectors - d->extent_sectors;
+    block_sector_t start = end, cnt = 0, i;
+
+    if (end != 0)
+      cnt = free_map_extend (end, want);
+    if (cnt == 0) {
+      for (cnt = want; cnt > 0; cnt /= 2)
+        if (free_map_allocate (cnt, &start))
+          break;
+    }
+    if (cnt == 0 || !extent_append (d, start, cnt)) {
+      if (cnt != 0)
+        free_map_release (start, cnt);
+      success = false;
+      break;
+    }
+    for (i = 0; i < cnt && !direct; i++) {
+      buffer_write (fs_device, start + i, zeros, 0, BLOCK_SECTOR_SIZE);
+      journal_data (start + i, true);
+    }
+    for (i = 0; i < cnt && direct; i += ZERO_SECTORS) {
+      block_sector_t n = cnt - i < ZERO_SECTORS ? cnt - i : ZERO_SECTORS;
+      block_sector_t j;
+
+      // on disk before the handle ends, so nothing need be ordered
+      for (j = 0; j < n; j++)
+        journal_data (start + i + j, false);
+      buffer_overwrite (fs_device, start + i, n, zeros);
+      block_write_multi (fs_device, start + i, n, zeros);
+      // read-ahead may have cached the old data meanwhile
+      buffer_overwrite (fs_device, start + i, n, zeros);
+    }
+    d->extent_sectors += cnt;
+    end = start + cnt;
+  }
+  if (direct)
+    palloc_free_page (zeros);
+  else
+    free (zeros);
+  return success;
+}
+
+/* Frees every sector of extent inode D, data and tree alike. */
+static void
+extent_release (struct inode_disk *d)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < d->extent_cnt; i++)
+    free_map_release (d->extents[i].start, d->extents[i].length);
+  if (d->extent_root != 0) {
+    struct extent_root *root = malloc (sizeof *root);
+    struct extent_leaf *leaf = malloc (sizeof *leaf);
+    if (root == NULL || leaf == NULL)
+      PANIC ("out of memory releasing extents");
+    buffer_read (fs_device, d->extent_root, root, 0, BLOCK_SECTOR_SIZE);
+    for (i = 0; i < EXTENT_ROOT_CNT && root->leaves[i].leaf != 0; i++) {
+      buffer_read (fs_device, root->leaves[i].leaf, leaf, 0,
+                   BLOCK_SECTOR_SIZE);
+      for (j = 0; j < leaf->cnt; j++)
+        free_map_release (leaf->extents[j].start, leaf->extents[j].length);
+      free_map_release (root->leaves[i].leaf, 1);
+    }
+    free_map_release (d->extent_root, 1);
+    free (root);
+    free (leaf);
+  }
+}
+
+/* Open inodes by sector, so that opening a single inode twice
+   returns the same `struct inode'.  It also holds the inodes on
+   closed_inodes. */
+static struct hash inode_table;
+
+/* Inodes that are not open any more but are kept, with their
+   on-disk data, so that opening them again needs no disk read.
+   Least recently closed first. */
+static struct list closed_inodes;
+static size_t closed_cnt;
+
+/* Protects inode_table, closed_inodes, every open_cnt and every
+   loading flag.  No I/O is done while it is held; an inode being
+   read in is in the table with loading set, and inode_loaded is
+   signaled once it is not. */
+static struct lock inode_table_lock;
+static struct condition inode_loaded;
+
+/* Removed inodes closed by their last opener, whose sectors the
+   reclaim thread has yet to free, oldest first.  Protected by
+   reclaim_list_lock; the reclaim thread waits on reclaim_queued
+   for it to fill. */
+static struct list reclaim_list;
+static struct lock reclaim_list_lock;
+static struct condition reclaim_queued;
+
+/* Held while sectors of inodes taken off reclaim_list are freed,
+   so that inode_reclaim () can wait for them. */
+static struct lock reclaim_lock;
+
+static void reclaim_thread (void *aux);
+static bool reclaim_all (void);
+
+/* Hashes an inode by its sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, hash_elem);
+  return hash_int (inode->sector);
+}
+
+/* Orders inodes by sector. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, hash_elem)->sector
+          < hash_entry (b, struct inode, hash_elem)->sector);
+}
+
+/* Returns the inode for SECTOR in inode_table, or a null
+   pointer.  The caller must hold inode_table_lock. */
+static struct inode *
+inode_find (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&inode_table, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct inode, hash_elem) : NULL;
+}
+
+/* Puts INODE, which was just closed by its last opener, on
+   closed_inodes, and frees the least recently closed inode if
+   that makes too many.  The caller must hold inode_table_lock,
+   which this function releases. */
+static void
+inode_park (struct inode *inode)
+{
+  struct inode *victim = NULL;
+
+  /* Only the inode itself is worth keeping; its index copies
+     can take many sectors. */
+  inode_drop_index (inode);
+  list_push_back (&closed_inodes, &inode->lru_elem);
+  if (++closed_cnt > CLOSED_INODE_MAX)
+    {
+      victim = list_entry (list_pop_front (&closed_inodes),
+                           struct inode, lru_elem);
+      hash_delete (&inode_table, &victim->hash_elem);
+      closed_cnt--;
+    }
+  lock_release (&inode_table_lock);
+  free (victim);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&inode_table, inode_hash, inode_less, NULL))
+    PANIC ("inode table creation failed");
+  list_init (&closed_inodes);
+  lock_init (&inode_table_lock);
+  cond_init (&inode_loaded);
+  list_init (&reclaim_list);
+  lock_init (&reclaim_list_lock);
+  cond_init (&reclaim_queued);
+  lock_init (&reclaim_lock);
+  thread_create ("reclaim", PRI_DEFAULT, reclaim_thread, NULL);
+}
+
+/* Reclaim thread.  Frees the sectors of the removed inodes that
+   inode_close () queues, so that closing the last opener of a
+   large removed file does not wait for its index to be walked. */
+static void
+reclaim_thread (void *aux UNUSED)
+{
+  for (;;) {
+    lock_acquire (&reclaim_list_lock);
+    while (list_empty (&reclaim_list))
+      cond_wait (&reclaim_queued, &reclaim_list_lock);
+    lock_release (&reclaim_list_lock);
+    reclaim_all ();
+  }
+}
+
+/* Frees the sectors of every inode on reclaim_list, and the
+   inodes themselves.  Returns true if it had to wait for another
+   thread doing the same, in which case that thread may also have
+   freed some sectors, or if it freed any itself. */
+static bool
+reclaim_all (void)
+{
+  bool progress = false;
+
+  /* The handle comes first: a thread that holds reclaim_lock
+     never waits for a commit, which could be waiting for the
+     handle of a thread that waits for reclaim_lock. */
+  journal_begin ();
+  if (!lock_try_acquire (&reclaim_lock)) {
+    lock_acquire (&reclaim_lock);
+    progress = true;
+  }
+  for (;;) {
+    struct inode *inode = NULL;
+
+    lock_acquire (&reclaim_list_lock);
+    if (!list_empty (&reclaim_list))
+      inode = list_entry (list_pop_front (&reclaim_list),
+                          struct inode, lru_elem);
+    lock_release (&reclaim_list_lock);
+    if (inode == NULL)
+      break;
+
+    free_map_release (inode->sector, 1);
+    if (inode->data.magic == EXTENT_MAGIC)
+      extent_release (&inode->data);
+    else
+      release_data (&inode->data);
+    inode_drop_index (inode);
+    free (inode);
+    progress = true;
+  }
+  lock_release (&reclaim_lock);
+  journal_end ();
+  return progress;
+}
+
+/* Frees the sectors of the removed inodes still waiting for the
+   reclaim thread, in the calling thread, after the reclaim thread
+   is done with those it took.  Called when the disk looks full
+   and before shutting down.  Returns true if any sectors may have
+   been freed meanwhile. */
+bool
+inode_reclaim (void)
+{
+  return reclaim_all ();
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -121,6 +1017,7 @@ bool
 inode_create (block_sector_t sector, off_t length)
 {
   struct inode_disk *disk_inode = NULL;
+  struct inode *stale;
   bool success = false;
 
   ASSERT (length >= 0);
@@ -131,137 +1028,142 @@ inode_create (block_sector_t sector, off_t length)
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+  /* SECTOR may have held an inode that was closed and then freed
+     without being removed, e.g. when creating a file failed half
+     way.  Forget it, or reopening SECTOR would find stale data. */
+  lock_acquire (&inode_table_lock);
+  stale = inode_find (sector);
+  if (stale != NULL)
+    {
+      ASSERT (stale->open_cnt == 0);
+      list_remove (&stale->lru_elem);
+      closed_cnt--;
+      hash_delete (&inode_table, &stale->hash_elem);
+    }
+  lock_release (&inode_table_lock);
+  free (stale);
+
   disk_inode = calloc (1, sizeof *disk_inode);
-  if (disk_inode != NULL)
+  if (disk_inode != NULL && inode_format == INODE_EXTENTS)
+    {
+      disk_inode->length = length;
+      disk_inode->magic = EXTENT_MAGIC;
+      success = extent_grow (disk_inode, bytes_to_sectors (length), false);
+      if (success) {
+        journal_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+      } else
+        extent_release (disk_inode);
+    }
+  else if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
+      // reserve the data sectors without writing them; the first
+      // write to each one zeroes it in the cache
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      int index = length / BLOCK_SECTOR_SIZE;
-      int i = 0;
-      char *zeros = calloc(1, BLOCK_SECTOR_SIZE);
-      // static char zeros[BLOCK_SECTOR_SIZE];
-      block_sector_t *tmpsect_1st = NULL;
-      block_sector_t *tmpsect_2nd = NULL;
-      block_sector_t *tmpsect_2level_1 = NULL;
-      if (index >= DIR_LEN) {
-        // printf("inside the inode create has indir pnt\n");
-        // 1st indir
-        success = free_map_allocate (1, &(disk_inode->single_indir[0]));
-        tmpsect_1st = calloc(1, BLOCK_SECTOR_SIZE);
-      } 
-      if (index >= DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-        // 2nd indir
-        success = free_map_allocate (1, &(disk_inode->single_indir[1]));
-        tmpsect_2nd = calloc(1, BLOCK_SECTOR_SIZE);
-      }
-      if (index >= DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-
-        success = free_map_allocate (1, &(disk_inode->double_indir));
-        tmpsect_2level_1 = calloc(1, BLOCK_SECTOR_SIZE);
-        int tmp_index = index - (DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4);
-        int tmp_index2 = tmp_index / (BLOCK_SECTOR_SIZE / 4);
-        for (i = 0; i <= tmp_index2; i++) {
-          success = free_map_allocate (1, &(tmpsect_2level_1[i]));
-        }
-        buffer_write (fs_device, disk_inode->double_indir, tmpsect_2level_1, 0, BLOCK_SECTOR_SIZE);
-      }
-      // alloc the data sector
-      block_sector_t *cur_sector = calloc(1, BLOCK_SECTOR_SIZE);
-      for (i = 0; i <= index; i++) {
-        if (i < DIR_LEN) {
-          success = free_map_allocate (1, &(disk_inode->dir[i]));
-          buffer_write (fs_device, disk_inode->dir[i], zeros, 0, BLOCK_SECTOR_SIZE);
-        } else if (i < DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-          // 1st 1-level
-          int index_1st_level = i - DIR_LEN;
-          success = free_map_allocate (1, &(tmpsect_1st[index_1st_level]));
-          buffer_write (fs_device, tmpsect_1st[index_1st_level] ,zeros, 0, BLOCK_SECTOR_SIZE);
-        } else if (i < DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-          int index_1st_level = i - DIR_LEN - BLOCK_SECTOR_SIZE / 4;
-          success = free_map_allocate (1, &(tmpsect_2nd[index_1st_level]));
-          buffer_write (fs_device, tmpsect_2nd[index_1st_level] ,zeros, 0, BLOCK_SECTOR_SIZE);
-        } else {
-          // double director case
-          int index_1st_level = i - DIR_LEN - 2 * BLOCK_SECTOR_SIZE / 4;
-          int tmp_index = index_1st_level / (BLOCK_SECTOR_SIZE / 4);
-          int tmp_index2 = index_1st_level % (BLOCK_SECTOR_SIZE / 4);
-          
-          if (tmp_index2 == 0) {
-            // beginng of the 2-level page
-            memset (cur_sector, 0, BLOCK_SECTOR_SIZE);
-          }
-          
-          success = free_map_allocate (1, &(cur_sector[tmp_index2]));
-          buffer_write (fs_device, cur_sector[tmp_index2], zeros, 0, BLOCK_SECTOR_SIZE);
-          if (tmp_index2 == BLOCK_SECTOR_SIZE / 4 - 1) {
-            // last entry of the 2-level page
-            buffer_write (fs_device, tmpsect_2level_1[tmp_index], cur_sector, 0, BLOCK_SECTOR_SIZE);
-          } else if (i == index) {
-            // last entry
-            buffer_write (fs_device, tmpsect_2level_1[tmp_index], cur_sector, 0, BLOCK_SECTOR_SIZE);
-            // NOTICE, the last page may contain useless 0s
-          }
-        } 
-      }
-      // write back the page content to the disk
-      if (tmpsect_1st != NULL) {
-        buffer_write (fs_device, disk_inode->single_indir[0], tmpsect_1st, 0, BLOCK_SECTOR_SIZE);
-      }
-      if (tmpsect_2nd != NULL) {
-        buffer_write (fs_device, disk_inode->single_indir[1], tmpsect_2nd, 0, BLOCK_SECTOR_SIZE);
-      }
-      free (tmpsect_1st);
-      free (tmpsect_2nd);
-      free (tmpsect_2level_1);
-      free (cur_sector);
-      free (zeros);
-      // write back the inode
-      buffer_write (fs_device, sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-      success = true; 
+      journal_write (sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+      success = inode_reserve (sector, length);
     }
     free (disk_inode);
   return success;
 }
 
+/* Allocates the sectors for the first LENGTH bytes of the new
+   INODE_MAGIC inode in SECTOR, marked UNWRITTEN, along with the
+   index sectors that point to them.  On failure frees them all
+   again and returns false. */
+static bool
+inode_reserve (block_sector_t sector, off_t length)
+{
+  struct inode *inode;
+  size_t i;
+  bool success = true;
+
+  if (length == 0)
+    return true;
+  inode = inode_open (sector);
+  if (inode == NULL)
+    return false;
+  lock_acquire (&inode->extend_lock);
+  for (i = 0; success && i < bytes_to_sectors (length); i++)
+    success = sector_for_write (inode, i * BLOCK_SECTOR_SIZE, true)
+              != HOLE_SECTOR;
+  if (!success) {
+    inode_drop_index (inode);
+    release_data (&inode->data);
+  }
+  inode_write_disk (inode);
+  lock_release (&inode->extend_lock);
+  inode_close (inode);
+  return success;
+}
+
 /* Reads an inode from SECTOR
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already open, or was closed
+     recently enough to still be in memory. */
+  lock_acquire (&inode_table_lock);
+  inode = inode_find (sector);
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      if (inode->open_cnt++ == 0)
         {
-          inode_reopen (inode);
-          return inode; 
+          list_remove (&inode->lru_elem);
+          closed_cnt--;
         }
+      while (inode->loading)
+        cond_wait (&inode_loaded, &inode_table_lock);
+      lock_release (&inode_table_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL) {
+    lock_release (&inode_table_lock);
     return NULL;
   }
     
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode goes into the table marked loading
+     before the table lock is dropped to read it, so that a
+     concurrent open of SECTOR waits for it instead of reading it
+     a second time or seeing it half built. */
   inode->sector = sector;
+  hash_insert (&inode_table, &inode->hash_elem);
   inode->open_cnt = 1;
+  inode->loading = true;
   inode->deny_write_cnt = 0;
   inode->removed = false;
+  inode->metadata = false;
+  inode->dirty = false;
   // init the lock
   lock_init (&inode->extend_lock);
-  lock_init (&inode->length_lock);
+  range_lock_init (&inode->ranges);
+  lock_init (&inode->dir_lock);
+  inode->ra_start = -1;
+  inode->ra_end = -1;
+  inode->ra_stride = 0;
+  inode->ra_window = 0;
+  inode->ra_queued = -1;
+  lock_init (&inode->index_lock);
+  inode->indir_copy[0] = inode->indir_copy[1] = NULL;
+  inode->dindir_copy = NULL;
+  inode->dindir_leaf_copy = NULL;
+  inode->ext_first = 0;
+  inode->ext_hint.start = inode->ext_hint.length = 0;
+  lock_release (&inode_table_lock);
+
   buffer_read (fs_device, inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+  lock_acquire (&inode_table_lock);
+  inode->loading = false;
+  cond_broadcast (&inode_loaded, &inode_table_lock);
+  lock_release (&inode_table_lock);
   return inode;
 }
 
@@ -270,7 +1172,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table_lock);
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+    }
   return inode;
 }
 
@@ -281,9 +1187,25 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;   // inode num is the sector num
 }
 
+/* Returns true if INODE was removed. */
+bool
+inode_is_removed (const struct inode *inode)
+{
+  return inode->removed;
+}
+
+/* Returns the lock that directory operations hold on INODE while
+   they change or walk its entries. */
+struct lock *
+inode_dir_lock (struct inode *inode)
+{
+  return &inode->dir_lock;
+}
+
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, hands it to the reclaim
+   thread, which frees its blocks and then its memory. */
 void
 inode_close (struct inode *inode) 
 {
@@ -291,84 +1213,86 @@ inode_close (struct inode *inode)
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* Release resources if this was the last opener.  An inode
+     that still exists is kept in memory for a while instead.  The
+     last opener writes it back first, keeping its reference and
+     not the table lock meanwhile, and checks again afterwards in
+     case another thread opened and changed it in between. */
+  lock_acquire (&inode_table_lock);
+  while (inode->open_cnt == 1 && !inode->removed && inode->dirty)
+    {
+      lock_release (&inode_table_lock);
+      inode_write_back (inode);
+      lock_acquire (&inode_table_lock);
+    }
+  if (--inode->open_cnt > 0)
+    {
+      lock_release (&inode_table_lock);
+      return;
+    }
+  if (!inode->removed)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
-      
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
+      inode_park (inode);
+      return;
+    }
+  hash_delete (&inode_table, &inode->hash_elem);
+  lock_release (&inode_table_lock);
+
+  /* Leave deallocating its blocks to the reclaim thread. */
+  lock_acquire (&reclaim_list_lock);
+  list_push_back (&reclaim_list, &inode->lru_elem);
+  cond_signal (&reclaim_queued, &reclaim_list_lock);
+  lock_release (&reclaim_list_lock);
+}
+
+/* Writes every dirty in-memory inode to the buffer cache, so that
+   the next flush of the cache takes it to disk.  The inodes are
+   taken out of the table FLUSH_BATCH at a time, each with a
+   reference, and written after the table lock is released. */
+void
+inode_flush (void)
+{
+  struct inode *batch[FLUSH_BATCH];
+  size_t cnt, i;
+
+  do
+    {
+      struct hash_iterator it;
+
+      cnt = 0;
+      lock_acquire (&inode_table_lock);
+      hash_first (&it, &inode_table);
+      while (cnt < FLUSH_BATCH && hash_next (&it))
         {
-          // i.e. we delete the file corresponding to this inode
-          // free the inode itself on the disk
-          free_map_release (inode->sector, 1);
-
-          // remove every data
-          struct inode_disk *disk_inode = &inode->data;
-          int index = disk_inode->length / BLOCK_SECTOR_SIZE;
-          int i = 0;
-          block_sector_t *tmpsect_1st = NULL;
-          block_sector_t *tmpsect_2nd = NULL;
-          block_sector_t *tmpsect_2level_1 = NULL;
-
-          // read and free the internal page
-          if (index >= DIR_LEN) {
-            // 1st indir
-            tmpsect_1st = calloc(1, BLOCK_SECTOR_SIZE);
-            buffer_read (fs_device, disk_inode->single_indir[0], tmpsect_1st, 0, BLOCK_SECTOR_SIZE);
-            free_map_release (disk_inode->single_indir[0], 1);
-          } 
-          if (index >= DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-            // 2nd indir
-            tmpsect_2nd = calloc(1, BLOCK_SECTOR_SIZE);
-            buffer_read (fs_device, disk_inode->single_indir[1], tmpsect_2nd, 0, BLOCK_SECTOR_SIZE);
-            free_map_release (disk_inode->single_indir[1], 1);
-          }
-          if (index >= DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-            tmpsect_2level_1 = calloc(1, BLOCK_SECTOR_SIZE);
-            buffer_read (fs_device, disk_inode->double_indir, tmpsect_2level_1, 0, BLOCK_SECTOR_SIZE);
-            free_map_release (disk_inode->double_indir, 1);
-          }
-
-          block_sector_t *cur_sector = calloc(1, BLOCK_SECTOR_SIZE);
-
-          // free the data 
-          for (i = 0; i <= index; i++) {
-            if (i < DIR_LEN) {
-              free_map_release (disk_inode->dir[i], 1);
-            } else if (i < DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-              // 1st 1-level
-              int index_1st_level = i - DIR_LEN;
-              free_map_release (tmpsect_1st[index_1st_level], 1);
-            } else if (i < DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-              int index_1st_level = i - DIR_LEN - BLOCK_SECTOR_SIZE / 4;
-              free_map_release (tmpsect_2nd[index_1st_level], 1);
-            } else {
-              int index_1st_level = i - DIR_LEN - 2 * BLOCK_SECTOR_SIZE / 4;
-              int tmp_index = index_1st_level / (BLOCK_SECTOR_SIZE / 4);
-              int tmp_index2 = index_1st_level % (BLOCK_SECTOR_SIZE / 4);
-              if (tmp_index2 == 0) {
-                buffer_read (fs_device, tmpsect_2level_1[tmp_index], cur_sector, 0, BLOCK_SECTOR_SIZE);
-              }
-              free_map_release (cur_sector[tmp_index2], 1);
-              if (tmp_index2 == BLOCK_SECTOR_SIZE / 4 - 1) {
-                // we finish this 2-level page
-                free_map_release (tmpsect_2level_1[tmp_index], 1);
-              } else if (i == index) {
-                // last case
-                free_map_release (tmpsect_2level_1[tmp_index], 1);
-              }
+          struct inode *inode = hash_entry (hash_cur (&it), struct inode,
+                                            hash_elem);
+          if (!inode->dirty || inode->removed || inode->loading)
+            continue;
+          if (inode->open_cnt++ == 0)
+            {
+              list_remove (&inode->lru_elem);
+              closed_cnt--;
             }
-          }
-          free (tmpsect_1st);
-          free (tmpsect_2nd);
-          free (tmpsect_2level_1);
-          free (cur_sector);
+          batch[cnt++] = inode;
         }
+      lock_release (&inode_table_lock);
 
-      free (inode); 
+      for (i = 0; i < cnt; i++)
+        {
+          inode_write_back (batch[i]);
+          inode_close (batch[i]);
+        }
     }
+  while (cnt == FLUSH_BATCH);
+}
+
+/* Marks INODE as holding file system metadata, a directory or
+   the free map, whose data the journal logs like the inode
+   itself. */
+void
+inode_set_metadata (struct inode *inode)
+{
+  inode->metadata = true;
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -380,6 +1304,20 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Returns the cache entry of the sector that holds byte POS of
+   INODE, with shared access, so that the caller can read it in
+   place.  The caller must give it back with buffer_release (),
+   WRITE false.  Returns a null pointer if POS is past the end of
+   INODE or in a hole, which inode_read_at () reads as zeros. */
+struct sector_cache *
+inode_acquire_sector (struct inode *inode, off_t pos)
+{
+  block_sector_t sector = byte_to_sector (inode, pos);
+  if (sector == (block_sector_t) -1 || sector == HOLE_SECTOR)
+    return NULL;
+  return buffer_acquire (fs_device, sector, false);
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -390,7 +1328,12 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
   off_t bytes_read = 0;
   uint8_t *bounce = NULL;
   off_t inode_len = inode_length (inode);
+  struct range range;
 
+  // only writes that overlap the bytes read are kept out
+  range_lock_acquire (&inode->ranges, &range, offset, offset + size, false);
+  inode_read_ahead (inode, offset, size, inode_len);
+  inode_load (inode, offset, size, inode_len);
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -407,16 +1350,130 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
-      buffer_read (fs_device, sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
+      if (sector_idx == HOLE_SECTOR)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else
+        buffer_read (fs_device, sector_idx, buffer + bytes_read, sector_ofs,
+                     chunk_size);
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
+  range_lock_release (&inode->ranges, &range);
   free (bounce);
   return bytes_read;
 }
 
+/* Brings the sectors that hold SIZE bytes at OFFSET of INODE into
+   the cache before inode_read_at () copies them out, with one
+   buffer_load () per run of consecutive sectors on the device.
+   Reads within a single sector are left to the copy loop. */
+static void
+inode_load (struct inode *inode, off_t offset, off_t size,
+            off_t inode_len)
+{
+  block_sector_t run_start = 0;
+  size_t run_len = 0;
+  int idx, last;
+
+  if (size > inode_len - offset)
+    size = inode_len - offset;
+  if (size <= 0)
+    return;
+  idx = offset / BLOCK_SECTOR_SIZE;
+  last = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+  if (idx == last)
+    return;
+  for (; idx <= last; idx++) {
+    block_sector_t sector =
+      byte_to_sector_helper (inode, idx * BLOCK_SECTOR_SIZE, inode_len);
+    if (run_len > 0 && sector == run_start + run_len) {
+      run_len++;
+      continue;
+    }
+    if (run_len > 0)
+      buffer_load (fs_device, run_start, run_len);
+    // a hole has nothing to load and ends the run
+    run_start = sector;
+    run_len = sector != HOLE_SECTOR;
+  }
+  if (run_len > 0)
+    buffer_load (fs_device, run_start, run_len);
+}
+
+/* Tracks the access pattern of INODE for a read of SIZE bytes at
+   OFFSET and queues asynchronous read-ahead when the reads follow
+   a constant stride.  Back-to-back reads are the common case: a
+   read that starts in the sector where the last one ended, or in
+   the next one, counts as sequential, so reads smaller than a
+   sector also qualify, and the sectors after it are queued.  The
+   window doubles on every read that follows the pattern, up to
+   READ_AHEAD_MAX sectors, and collapses as soon as one does not. */
+static void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size,
+                  off_t inode_len)
+{
+  int last_sector = DIV_ROUND_UP (inode_len, BLOCK_SECTOR_SIZE) - 1;
+  int start, end, len, stride, k, predicted;
+  bool sequential;
+
+  if (size <= 0 || offset >= inode_len)
+    return;
+  start = offset / BLOCK_SECTOR_SIZE;
+  end = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+  stride = start - inode->ra_start;
+  sequential = inode->ra_end >= 0 && (start == inode->ra_end
+                                      || start == inode->ra_end + 1);
+  if (sequential || (stride > 0 && stride == inode->ra_stride)) {
+    inode->ra_window = inode->ra_window == 0 ? 2 : inode->ra_window * 2;
+    if (inode->ra_window > READ_AHEAD_MAX)
+      inode->ra_window = READ_AHEAD_MAX;
+  } else {
+    inode->ra_window = 0;
+    inode->ra_queued = -1;
+  }
+  inode->ra_start = start;
+  inode->ra_end = end;
+  inode->ra_stride = stride;
+
+  if (sequential) {
+    // the sectors right after this read
+    for (k = 1; k <= inode->ra_window && end + k <= last_sector; k++)
+      read_ahead_queue (inode, end + k, inode_len);
+    return;
+  }
+
+  // queue the reads we expect next: the same number of sectors
+  // at each of the following strides
+  len = end - start + 1;
+  predicted = 0;
+  for (k = 1; predicted < inode->ra_window; k++) {
+    int i;
+    for (i = 0; i < len && predicted < inode->ra_window; i++, predicted++) {
+      int idx = start + k * stride + i;
+      if (idx > last_sector)
+        return;
+      read_ahead_queue (inode, idx, inode_len);
+    }
+  }
+}
+
+/* Queues a read-ahead of sector index IDX of INODE, unless an
+   earlier read already queued it or it is a hole. */
+static void
+read_ahead_queue (struct inode *inode, int idx, off_t inode_len)
+{
+  block_sector_t sector;
+
+  if (idx <= inode->ra_queued)
+    return;
+  sector = byte_to_sector_helper (inode, idx * BLOCK_SECTOR_SIZE, inode_len);
+  if (sector != HOLE_SECTOR)
+    buffer_prefetch (fs_device, sector);
+  inode->ra_queued = idx;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs.
@@ -430,6 +1487,7 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
   uint8_t *bounce = NULL;
+  struct range range;
 
   if (inode->deny_write_cnt)
     return 0;
@@ -437,14 +1495,28 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
   if (newLen > MAX_LEN) {
     return 0;
   }
-  inode_extend_length (inode, size, offset);
-
+  // a write inside the file locks only the bytes it touches.  One
+  // that goes past the end locks everything from the end on, so
+  // that extending writes take turns while readers and writers
+  // before the end carry on
   off_t inodeLen = inode_length (inode);
+  if (newLen > inodeLen)
+    range_lock_acquire (&inode->ranges, &range,
+                        offset < inodeLen ? offset : inodeLen, MAX_LEN, true);
+  else
+    range_lock_acquire (&inode->ranges, &range, offset, newLen, true);
+  if (!inode_extend_length (inode, size, offset, false)) {
+    range_lock_release (&inode->ranges, &range);
+    return 0;
+  }
+
+  inodeLen = inode_length (inode);
   newLen = inodeLen > newLen ? inodeLen : newLen;
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector_helper (inode, offset, newLen);
+      block_sector_t sector_idx = lookup_sector (inode, offset, newLen);
+      bool hole = sector_idx == HOLE_SECTOR;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = newLen - offset;
@@ -456,132 +1528,326 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0) {
         break;
       }
-      buffer_write (fs_device, sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
+      // an extent inode has every sector mapped up to its length;
+      // no mapping means the extent table is short, so fail the write
+      // instead of mistaking -1 for a reserved sector
+      if (sector_idx == (block_sector_t) -1)
+        break;
+      if (inode->data.magic != EXTENT_MAGIC
+          && (hole || (sector_idx & UNWRITTEN))) {
+        // first write to this sector.  Clearing an UNWRITTEN mark
+        // is logged like filling a hole, so that the pointer
+        // reaches the disk only after the zeroed sector does
+        journal_begin ();
+        lock_acquire (&inode->extend_lock);
+        sector_idx = sector_for_write (inode, offset, false);
+        if (inode->dirty)
+          inode_write_disk (inode);
+        lock_release (&inode->extend_lock);
+        journal_end ();
+        if (sector_idx == HOLE_SECTOR)
+          break;
+      }
+      if (inode->metadata)
+        journal_write (sector_idx, buffer + bytes_written, sector_ofs,
+                       chunk_size);
+      else
+        buffer_write (fs_device, sector_idx, buffer + bytes_written,
+                      sector_ofs, chunk_size);
  
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  // update the inode length
-  struct inode_disk *disk_inode = &inode->data;
-  lock_acquire (&inode->length_lock);
-  disk_inode->length = newLen;
-  buffer_write (fs_device, inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-  lock_release (&inode->length_lock);
+  // update the inode length, to no further than the data went if
+  // the disk filled up
+  if (size > 0 && offset < newLen)
+    newLen = offset > inodeLen ? offset : inodeLen;
+  // the inode itself is only written back when it is closed or
+  // flushed.  The journal logs it along with the sectors written
+  // into holes, so its pointers never reach the disk before they
+  // are committed; the length alone is not worth a transaction.
+  // Only a writer holding the tail gets here with a longer length.
+  if (newLen > inode->data.length) {
+    // readers do not lock, so the data must be there first
+    barrier ();
+    inode->data.length = newLen;
+    inode->dirty = true;
+  }
+  range_lock_release (&inode->ranges, &range);
+  // a directory's inode goes with the entries the journal logs
+  if (inode->dirty && inode->metadata)
+    inode_write_back (inode);
   free (bounce);
   return bytes_written;
 }
 
-/* Function to extend the inode */
-void
+/* Function to extend the inode.  Only extent inodes allocate
+   here; indexed inodes leave the new part as holes.  If DIRECT,
+   new sectors are zeroed on the device rather than in the
+   cache.  Returns false if the disk is full. */
+bool
 inode_extend_length (struct inode *inode, off_t size,
-                off_t offset)
+                off_t offset, bool direct)
 {
+  bool success = true;
+  int newLen = offset + size;
 
+  // INODE_MAGIC inodes get their sectors when they are written
+  if (inode->data.magic != EXTENT_MAGIC
+      || bytes_to_sectors (newLen) <= inode->data.extent_sectors)
+    return true;
+  journal_begin ();
   lock_acquire (&inode->extend_lock);
-  int newLen = offset + size;
-  int oldLen = inode_length(inode);
-  if (oldLen < newLen) {
-    struct inode_disk *disk_inode = &inode->data;
-    int newindex = newLen / BLOCK_SECTOR_SIZE;
-    int oldindex = oldLen / BLOCK_SECTOR_SIZE;
-    char *zeros = calloc(1, BLOCK_SECTOR_SIZE);
-    // static char zeros[BLOCK_SECTOR_SIZE];
-    block_sector_t *tmpsect_1st = calloc(1, BLOCK_SECTOR_SIZE);
-    block_sector_t *tmpsect_2nd = calloc(1, BLOCK_SECTOR_SIZE);
-    block_sector_t *tmpsect_2level_1 = calloc(1, BLOCK_SECTOR_SIZE);
-    int i = 0;
-    if (newindex >= DIR_LEN && oldindex < DIR_LEN) {
-      // 1st indir
-      free_map_allocate (1, &(disk_inode->single_indir[0]));
-    } 
-    if (newindex >= DIR_LEN + BLOCK_SECTOR_SIZE / 4 &&
-      oldindex < DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-      // 2nd indir
-      free_map_allocate (1, &(disk_inode->single_indir[1]));
-    }
-    if (newindex >= DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-
-      if (oldindex < DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-        free_map_allocate (1, &(disk_inode->double_indir));
-      }
+  if (bytes_to_sectors (newLen) > inode->data.extent_sectors) {
+    success = extent_grow (&inode->data, bytes_to_sectors (newLen),
+                           direct);
+    inode_write_disk (inode);
+  }
+  lock_release (&inode->extend_lock);
+  journal_end ();
+  return success;
+}
 
-      buffer_read (fs_device, disk_inode->double_indir, tmpsect_2level_1, 0, BLOCK_SECTOR_SIZE);
-      // tmpsect_2level_1 = calloc(1, BLOCK_SECTOR_SIZE);
-      int newtmp_index = newindex - (DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4);
-      int newtmp_index2 = newtmp_index / (BLOCK_SECTOR_SIZE / 4);
 
-      int oldtmp_index = oldindex - (DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4);
-      int oldtmp_index2 = oldtmp_index / (BLOCK_SECTOR_SIZE / 4);
-      if (oldtmp_index < 0) {
-        oldtmp_index2 = -1;
-      }
-      for (i = oldtmp_index2 + 1; i <= newtmp_index2; i++) {
-        free_map_allocate (1, &(tmpsect_2level_1[i]));
-      }
+/* Direct I/O.  Whole sectors of a regular file go straight
+   between the caller's buffer and the device, in one transfer
+   per run of sectors that are consecutive on disk, so that
+   streaming a large file does not evict the cached sectors other
+   threads need.  The disk can only DMA to and from kernel memory,
+   so a user buffer is staged through BOUNCE_PAGES kernel pages,
+   at the cost of a copy; if they cannot be had, the disk moves
+   the data with PIO instead.  Sectors an extent inode grows by
+   are zeroed on the device too.  A transfer's unaligned head and
+   tail, holes, and the sectors of directories, which the journal
+   logs, still go through the cache. */
 
-      buffer_write (fs_device, disk_inode->double_indir, tmpsect_2level_1, 0, BLOCK_SECTOR_SIZE);
-    }
-
-    // read the internal pages
-    if (newindex >= DIR_LEN) {
-      buffer_read (fs_device, disk_inode->single_indir[0], tmpsect_1st, 0, BLOCK_SECTOR_SIZE);
-    }
-    if (newindex >= DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-      buffer_read (fs_device, disk_inode->single_indir[1], tmpsect_2nd, 0, BLOCK_SECTOR_SIZE);
-    }
-
-    // alloc the data sector
-    block_sector_t *cur_sector = calloc(1, BLOCK_SECTOR_SIZE);
-    for (i = oldindex + 1; i <= newindex; i++) {
-      if (i < DIR_LEN) {
-        free_map_allocate (1, &(disk_inode->dir[i]));
-        buffer_write (fs_device, disk_inode->dir[i], zeros, 0, BLOCK_SECTOR_SIZE);
-      } else if (i < DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-        // 1st 1-level
-        int index_1st_level = i - DIR_LEN;
-        free_map_allocate (1, &(tmpsect_1st[index_1st_level]));
-        buffer_write (fs_device, tmpsect_1st[index_1st_level] ,zeros, 0, BLOCK_SECTOR_SIZE);
-      } else if (i < DIR_LEN + 2 * BLOCK_SECTOR_SIZE / 4) {
-        int index_1st_level = i - DIR_LEN - BLOCK_SECTOR_SIZE / 4;
-        free_map_allocate (1, &(tmpsect_2nd[index_1st_level]));
-        buffer_write (fs_device, tmpsect_2nd[index_1st_level] ,zeros, 0, BLOCK_SECTOR_SIZE);
-      } else {
-        // double director case
-        int index_1st_level = i - DIR_LEN - 2 * BLOCK_SECTOR_SIZE / 4;
-        int tmp_index = index_1st_level / (BLOCK_SECTOR_SIZE / 4);
-        int tmp_index2 = index_1st_level % (BLOCK_SECTOR_SIZE / 4);
-        if (tmp_index2 == 0) {
-          // beginng of the 2-level page
-          memset (cur_sector, 0, BLOCK_SECTOR_SIZE);
-          // cur_sector = calloc(1, BLOCK_SECTOR_SIZE);
-        } else {
-          buffer_read (fs_device, tmpsect_2level_1[tmp_index], cur_sector, 0, BLOCK_SECTOR_SIZE);
-        }
-        
-        free_map_allocate (1, &(cur_sector[tmp_index2]));
-        buffer_write (fs_device, cur_sector[tmp_index2], zeros, 0, BLOCK_SECTOR_SIZE);
-        buffer_write (fs_device, tmpsect_2level_1[tmp_index], cur_sector, 0, BLOCK_SECTOR_SIZE);
-      } 
-    }
-    // write back the page content to the disk
-    if (newindex >= DIR_LEN) {
-      buffer_write (fs_device, disk_inode->single_indir[0], tmpsect_1st, 0, BLOCK_SECTOR_SIZE);
-    }
-    if (newindex >= DIR_LEN + BLOCK_SECTOR_SIZE / 4) {
-      buffer_write (fs_device, disk_inode->single_indir[1], tmpsect_2nd, 0, BLOCK_SECTOR_SIZE);
-    }
-    free (tmpsect_1st);
-    free (tmpsect_2nd);
-    free (tmpsect_2level_1);
-    free (cur_sector);
-    free (zeros);
-    buffer_write (fs_device, inode->sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+/* Returns the number of file sectors, at most CNT, starting at
+   sector-aligned byte POS of INODE that are held by consecutive
+   disk sectors, and sets *SECTORP to the first.  Returns 0 if
+   the first is a hole, UNWRITTEN or not below LEN.  If ALLOCATE
+   is true, holes and UNWRITTEN sectors of an INODE_MAGIC inode
+   are made writable on the way; the caller must then hold
+   extend_lock inside a journal handle. */
+static size_t
+direct_run (struct inode *inode, off_t pos, size_t cnt, off_t len,
+            bool allocate, block_sector_t *sectorp)
+{
+  size_t n;
+
+  for (n = 0; n < cnt; n++) {
+    off_t p = pos + n * BLOCK_SECTOR_SIZE;
+    block_sector_t sector = lookup_sector (inode, p, len);
+
+    if (allocate && inode->data.magic != EXTENT_MAGIC
+        && (sector == HOLE_SECTOR || (sector & UNWRITTEN)))
+      sector = sector_for_write (inode, p, false);
+    if (sector == HOLE_SECTOR || sector == (block_sector_t) -1
+        || (sector & UNWRITTEN))
+      break;
+    if (n == 0)
+      *sectorp = sector;
+    else if (sector != *sectorp + n)
+      break;
+  }
+  return n;
+}
+
+/* Reads up to CNT whole sectors at sector-aligned byte OFFSET of
+   INODE directly into BUFFER.  Returns the number of sectors
+   read, 0 if the first sector must go through the cache. */
+static size_t
+read_direct_run (struct inode *inode, void *buffer, size_t cnt,
+                 off_t offset)
+{
+  block_sector_t sector = 0;
+  struct range range;
+  off_t len;
+  size_t n, i;
+
+  range_lock_acquire (&inode->ranges, &range, offset,
+                      offset + cnt * BLOCK_SECTOR_SIZE, false);
+  len = inode_length (inode);
+  if (offset + (off_t) (cnt * BLOCK_SECTOR_SIZE) > len)
+    cnt = offset < len ? (len - offset) / BLOCK_SECTOR_SIZE : 0;
+  n = direct_run (inode, offset, cnt, len, false, &sector);
+  if (n > 0) {
+    // the device must first get what the cache has newer.  Writers
+    // of these bytes wait for the range, so none gets newer later
+    for (i = 0; i < n; i++)
+      buffer_write_back (fs_device, sector + i);
+    block_read_multi (fs_device, sector, n, buffer);
   }
+  range_lock_release (&inode->ranges, &range);
+  return n;
+}
+
+/* Writes CNT whole sectors from BUFFER directly at sector-aligned
+   byte OFFSET of INODE, allocating them if needed.  Returns the
+   number of sectors written, 0 if the first sector must go
+   through the cache or the disk is full. */
+static size_t
+write_direct_run (struct inode *inode, const void *buffer, size_t cnt,
+                  off_t offset)
+{
+  block_sector_t sector = 0;
+  off_t end = offset + cnt * BLOCK_SECTOR_SIZE;
+  struct range range;
+  off_t len;
+  size_t n;
+
+  if (end > MAX_LEN)
+    return 0;
+  // the same range as inode_write_at () would lock
+  len = inode_length (inode);
+  if (end > len)
+    range_lock_acquire (&inode->ranges, &range,
+                        offset < len ? offset : len, MAX_LEN, true);
+  else
+    range_lock_acquire (&inode->ranges, &range, offset, end, true);
+  if (!inode_extend_length (inode, end - offset, offset, true)) {
+    range_lock_release (&inode->ranges, &range);
+    return 0;
+  }
+
+  /* New sectors of an extent inode were zeroed on the device
+     above.  Those of an indexed inode start out as zeros in the
+     cache, and the journal only writes those back before the
+     pointers to them are committed.  Keeping the handle until the
+     data is on disk keeps a commit from finding the sectors
+     uncached, with whatever they held before on disk. */
+  journal_begin ();
+  lock_acquire (&inode->extend_lock);
+  n = direct_run (inode, offset, cnt, end, true, &sector);
+  if (inode->dirty)
+    inode_write_disk (inode);
   lock_release (&inode->extend_lock);
+  if (n > 0) {
+    // cached copies, dirty or not, get the new data, clean, so
+    // that nothing older is written back over it
+    buffer_overwrite (fs_device, sector, n, buffer);
+    block_write_multi (fs_device, sector, n, buffer);
+  }
+  journal_end ();
+  if (n > 0) {
+    // read-ahead may have cached the old data meanwhile
+    buffer_overwrite (fs_device, sector, n, buffer);
+    end = offset + n * BLOCK_SECTOR_SIZE;
+    if (end > inode->data.length) {
+      barrier ();
+      inode->data.length = end;
+      inode->dirty = true;
+    }
+  }
+  range_lock_release (&inode->ranges, &range);
+  return n;
 }
 
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, like inode_read_at (), but with direct I/O for the
+   whole sectors.  Each run of sectors is read atomically, not
+   the whole transfer. */
+off_t
+inode_read_direct (struct inode *inode, void *buffer_, off_t size,
+                   off_t offset)
+{
+  uint8_t *buffer = buffer_;
+  uint8_t *bounce = NULL;
+  off_t bytes_read = 0;
+
+  if (inode->metadata)
+    return inode_read_at (inode, buffer, size, offset);
+  if (!is_kernel_vaddr (buffer) && size >= BLOCK_SECTOR_SIZE)
+    bounce = palloc_get_multiple (0, BOUNCE_PAGES);
+  while (bytes_read < size)
+    {
+      off_t pos = offset + bytes_read;
+      off_t left = size - bytes_read;
+      int sector_ofs = pos % BLOCK_SECTOR_SIZE;
+      off_t chunk, n;
+
+      if (sector_ofs == 0 && left >= BLOCK_SECTOR_SIZE) {
+        size_t cnt = left / BLOCK_SECTOR_SIZE;
+
+        if (bounce == NULL)
+          n = read_direct_run (inode, buffer + bytes_read, cnt, pos);
+        else {
+          n = read_direct_run (inode, bounce,
+                               cnt < BOUNCE_SECTORS ? cnt : BOUNCE_SECTORS,
+                               pos);
+          memcpy (buffer + bytes_read, bounce, n * BLOCK_SECTOR_SIZE);
+        }
+        if (n > 0) {
+          bytes_read += n * BLOCK_SECTOR_SIZE;
+          continue;
+        }
+      }
+      // up to the next sector boundary through the cache
+      chunk = BLOCK_SECTOR_SIZE - sector_ofs;
+      if (chunk > left)
+        chunk = left;
+      n = inode_read_at (inode, buffer + bytes_read, chunk, pos);
+      bytes_read += n;
+      if (n < chunk)
+        break;
+    }
+  if (bounce != NULL)
+    palloc_free_multiple (bounce, BOUNCE_PAGES);
+  return bytes_read;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   like inode_write_at (), but with direct I/O for the whole
+   sectors.  Each run of sectors is written atomically, not the
+   whole transfer. */
+off_t
+inode_write_direct (struct inode *inode, const void *buffer_, off_t size,
+                    off_t offset)
+{
+  const uint8_t *buffer = buffer_;
+  uint8_t *bounce = NULL;
+  off_t bytes_written = 0;
+
+  if (inode->metadata || inode->deny_write_cnt)
+    return inode_write_at (inode, buffer, size, offset);
+  if (!is_kernel_vaddr (buffer) && size >= BLOCK_SECTOR_SIZE)
+    bounce = palloc_get_multiple (0, BOUNCE_PAGES);
+  while (bytes_written < size)
+    {
+      off_t pos = offset + bytes_written;
+      off_t left = size - bytes_written;
+      int sector_ofs = pos % BLOCK_SECTOR_SIZE;
+      off_t chunk, n;
+
+      if (sector_ofs == 0 && left >= BLOCK_SECTOR_SIZE) {
+        size_t cnt = left / BLOCK_SECTOR_SIZE;
+
+        if (bounce == NULL)
+          n = write_direct_run (inode, buffer + bytes_written, cnt, pos);
+        else {
+          if (cnt > BOUNCE_SECTORS)
+            cnt = BOUNCE_SECTORS;
+          memcpy (bounce, buffer + bytes_written, cnt * BLOCK_SECTOR_SIZE);
+          n = write_direct_run (inode, bounce, cnt, pos);
+        }
+        if (n > 0) {
+          bytes_written += n * BLOCK_SECTOR_SIZE;
+          continue;
+        }
+      }
+      chunk = BLOCK_SECTOR_SIZE - sector_ofs;
+      if (chunk > left)
+        chunk = left;
+      n = inode_write_at (inode, buffer + bytes_written, chunk, pos);
+      bytes_written += n;
+      if (n < chunk)
+        break;
+    }
+  if (bounce != NULL)
+    palloc_free_multiple (bounce, BOUNCE_PAGES);
+  return bytes_written;
+}
 
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
@@ -607,8 +1873,5 @@ inode_allow_write (struct inode *inode)
 off_t
 inode_length (const struct inode *inode)
 { 
-  lock_acquire (&inode->length_lock);
-  int len = inode->data.length;
-  lock_release (&inode->length_lock);
-  return len;
+  return inode->data.length;
 }
@@ -6,18 +6,41 @@
 #include "devices/block.h"
 
 struct bitmap;
+struct lock;
+struct sector_cache;
+
+/* On-disk layout of newly created inodes.  Inodes of either
+   format can be read. */
+enum inode_format
+  {
+    INODE_INDEXED,        /* Direct and indirect pointers, default. */
+    INODE_EXTENTS         /* Runs of consecutive sectors. */
+  };
+
+/* Chosen with kernel command-line option "-inode-format". */
+extern enum inode_format inode_format;
 
 void inode_init (void);
 bool inode_create (block_sector_t, off_t);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
+bool inode_is_removed (const struct inode *);
+struct lock *inode_dir_lock (struct inode *);
 void inode_close (struct inode *);
 void inode_remove (struct inode *);
+void inode_set_metadata (struct inode *);
+void inode_flush (void);
+bool inode_reclaim (void);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
+struct sector_cache *inode_acquire_sector (struct inode *, off_t pos);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_direct (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_direct (struct inode *, const void *, off_t size,
+                          off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
-void inode_extend_length (struct inode *inode, off_t size, off_t offset);
+bool inode_extend_length (struct inode *inode, off_t size, off_t offset,
+                          bool direct);
 #endif /* filesys/inode.h */
@@ -0,0 +1,485 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <string.h>
+#include "filesys/buffer.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal is a redo log of whole sectors.  Its first sector
+   is a superblock; the rest holds groups, one after another.  A
+   group is a descriptor, the images of the sectors it lists and
+   a commit record with a checksum of the descriptor and images.
+   At mount, the groups that are complete and in sequence are
+   written in place.  The log starts over once everything it
+   holds has been written in place. */
+
+/* Identify the superblock, a descriptor and a commit record. */
+#define SUPER_MAGIC 0x4a535550
+#define DESC_MAGIC 0x4a444553
+#define COMMIT_MAGIC 0x4a434d54
+
+/* First sector and number of sectors that hold groups. */
+#define LOG_START (JOURNAL_SECTOR + 1)
+#define LOG_SECTORS (JOURNAL_SECTORS - 1)
+
+/* Sectors a descriptor can list, logged and revoked together. */
+#define DESC_MAX ((BLOCK_SECTOR_SIZE - 16) / sizeof (block_sector_t))
+
+/* Most sectors one group logs: the descriptor lists them and the
+   group takes two more sectors of the log. */
+#define GROUP_MAX (LOG_SECTORS - 2 < DESC_MAX ? LOG_SECTORS - 2 : DESC_MAX)
+
+/* A handle that starts when the running group has logged this
+   many sectors commits the group first. */
+#define GROUP_SOFT (GROUP_MAX / 2)
+
+/* Most new data sectors a group writes back before it commits;
+   past that it flushes the whole cache instead. */
+#define ORDERED_MAX 128
+
+struct journal_super
+  {
+    uint32_t magic;
+    uint32_t seq;                       /* Sequence number of the first
+                                           group in the log. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 8];
+  };
+
+/* Lists the CNT sectors whose images follow, then RCNT revoked
+   sectors: the images of those in this group and earlier ones
+   are stale, because the sectors have become file data. */
+struct journal_desc
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t cnt;
+    uint32_t rcnt;
+    block_sector_t sectors[DESC_MAX];
+  };
+
+struct journal_commit
+  {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t checksum;                  /* hash_bytes () of the descriptor
+                                           and the images. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 12];
+  };
+
+/* Protects the handle count and the committing flag.  The rest
+   of the state below belongs to the handles while they are open
+   and to the committer while it is committing; journal_dirty ()
+   and journal_data () take the lock to update it. */
+static struct lock journal_lock;
+static struct condition handles_done;   /* Signaled when HANDLES is 0. */
+static struct condition commit_done;    /* Signaled when COMMITTING clears. */
+static int handles;                     /* Open outermost handles. */
+static bool committing;                 /* A commit is in progress. */
+
+/* The running group. */
+static block_sector_t logged[GROUP_MAX];  /* Sectors to log, held. */
+static size_t logged_cnt;
+static block_sector_t revoked[GROUP_MAX]; /* Sectors to revoke. */
+static size_t revoked_cnt;
+static bool overflow;                   /* More than a group can hold. */
+static block_sector_t ordered[ORDERED_MAX]; /* New data sectors. */
+static size_t ordered_cnt;
+static bool ordered_overflow;
+
+/* The log. */
+static uint32_t seq;                    /* Sequence number of the next group. */
+static size_t head;                     /* Log sector it goes to. */
+static block_sector_t in_log[LOG_SECTORS]; /* Sectors with an image in
+                                              the log. */
+static size_t in_log_cnt;
+
+/* Descriptor and images of a group, and a spare sector. */
+static uint8_t *group_buf;
+static uint8_t sector_buf[BLOCK_SECTOR_SIZE];
+
+static void commit (bool flush);
+static void write_group (void);
+static void release_held (void);
+static void empty_log (void);
+static bool read_group (size_t pos, uint32_t group_seq);
+static bool find (const block_sector_t *, size_t cnt, block_sector_t,
+                  size_t *idx);
+
+/* Initializes the journal module. */
+void
+journal_init (void)
+{
+  lock_init (&journal_lock);
+  cond_init (&handles_done);
+  cond_init (&commit_done);
+  group_buf = malloc ((GROUP_MAX + 1) * BLOCK_SECTOR_SIZE);
+  if (group_buf == NULL)
+    PANIC ("no memory for the journal");
+}
+
+/* Writes an empty journal, when formatting. */
+void
+journal_create (void)
+{
+  seq = 1;
+  empty_log ();
+}
+
+/* Writes in place every complete group in the log, in order,
+   then empties it.  Must be called at mount, before anything
+   reads the file system. */
+void
+journal_recover (void)
+{
+  struct journal_super *super = (struct journal_super *) sector_buf;
+  struct journal_desc *descs;
+  struct journal_desc *desc = (struct journal_desc *) group_buf;
+  size_t pos[LOG_SECTORS / 2];
+  size_t group_cnt = 0;
+  size_t g, h, i;
+
+  block_read (fs_device, JOURNAL_SECTOR, super);
+  if (super->magic != SUPER_MAGIC)
+    PANIC ("file system has no journal, it needs to be formatted");
+  seq = super->seq;
+
+  /* Find the complete groups, and keep their descriptors for the
+     revoked sectors. */
+  descs = malloc (LOG_SECTORS / 2 * sizeof *descs);
+  if (descs == NULL)
+    PANIC ("no memory to recover the journal");
+  for (head = 0; read_group (head, seq); head += desc->cnt + 2, seq++)
+    {
+      pos[group_cnt] = head;
+      memcpy (&descs[group_cnt++], desc, sizeof *desc);
+    }
+
+  /* Redo them, skipping images that a group from then on
+     revokes. */
+  for (g = 0; g < group_cnt; g++)
+    {
+      if (descs[g].cnt == 0)
+        continue;
+      block_read_multi (fs_device, LOG_START + pos[g] + 1, descs[g].cnt,
+                        group_buf);
+      for (i = 0; i < descs[g].cnt; i++)
+        {
+          block_sector_t sector = descs[g].sectors[i];
+          bool stale = false;
+
+          for (h = g; h < group_cnt && !stale; h++)
+            stale = find (descs[h].sectors + descs[h].cnt, descs[h].rcnt,
+                          sector, NULL);
+          if (!stale)
+            buffer_write (fs_device, sector,
+                          group_buf + i * BLOCK_SECTOR_SIZE, 0,
+                          BLOCK_SECTOR_SIZE);
+        }
+    }
+  free (descs);
+  buffer_update_disk ();
+  empty_log ();
+}
+
+/* Reads the group at log sector POS into group_buf and returns
+   true if it is complete and has sequence number GROUP_SEQ. */
+static bool
+read_group (size_t pos, uint32_t group_seq)
+{
+  struct journal_desc *desc = (struct journal_desc *) group_buf;
+  struct journal_commit *c = (struct journal_commit *) sector_buf;
+
+  if (pos + 2 > LOG_SECTORS)
+    return false;
+  block_read (fs_device, LOG_START + pos, desc);
+  if (desc->magic != DESC_MAGIC || desc->seq != group_seq
+      || desc->cnt > GROUP_MAX || desc->rcnt > DESC_MAX - desc->cnt
+      || pos + desc->cnt + 2 > LOG_SECTORS)
+    return false;
+  if (desc->cnt > 0)
+    block_read_multi (fs_device, LOG_START + pos + 1, desc->cnt,
+                      group_buf + BLOCK_SECTOR_SIZE);
+  block_read (fs_device, LOG_START + pos + desc->cnt + 1, c);
+  return (c->magic == COMMIT_MAGIC && c->seq == group_seq
+          && c->checksum == hash_bytes (group_buf, (desc->cnt + 1)
+                                                   * BLOCK_SECTOR_SIZE));
+}
+
+/* Opens a handle.  The metadata changes made until the matching
+   journal_end () are committed together.  Handles nest; only the
+   outermost one counts.  Must not be called with a lock held
+   that a thread inside a handle may wait for, since it may wait
+   for a commit, which waits for every handle to end. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+  if (logged_cnt >= GROUP_SOFT)
+    {
+      t->journal_depth--;
+      commit (false);
+      t->journal_depth++;
+    }
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&commit_done, &journal_lock);
+  handles++;
+  lock_release (&journal_lock);
+}
+
+/* Closes a handle opened by journal_begin (). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+  lock_acquire (&journal_lock);
+  if (--handles == 0)
+    cond_broadcast (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Notes that metadata SECTOR is about to be changed in the buffer
+   cache, so that the running group logs it, and holds it there
+   from now on.  Must come before the change: if it came after,
+   write-behind could write the change in place before the group
+   commits.  Does nothing outside a handle. */
+void
+journal_dirty (block_sector_t sector)
+{
+  size_t i;
+
+  if (thread_current ()->journal_depth == 0)
+    return;
+  lock_acquire (&journal_lock);
+  if (find (revoked, revoked_cnt, sector, &i))
+    revoked[i] = revoked[--revoked_cnt];
+  if (!find (logged, logged_cnt, sector, NULL))
+    {
+      if (logged_cnt + revoked_cnt < GROUP_MAX)
+        {
+          logged[logged_cnt++] = sector;
+          buffer_hold (fs_device, sector);
+        }
+      else
+        overflow = true;
+    }
+  lock_release (&journal_lock);
+}
+
+/* Writes SIZE bytes from BUFFER at byte OFFSET of metadata SECTOR
+   into the buffer cache, for the running group to log, holding
+   the sector first as journal_dirty () requires. */
+void
+journal_write (block_sector_t sector, const void *buffer, off_t offset,
+               off_t size)
+{
+  journal_dirty (sector);
+  buffer_write (fs_device, sector, buffer, offset, size);
+}
+
+/* Notes that SECTOR was just allocated as file data, so that any
+   image of it in the log is revoked.  If WRITE_BACK, it is also
+   written back before the running group commits, so that no
+   committed index points at what a deleted file left there.
+   Does nothing outside a handle. */
+void
+journal_data (block_sector_t sector, bool write_back)
+{
+  size_t i;
+
+  if (thread_current ()->journal_depth == 0)
+    return;
+  lock_acquire (&journal_lock);
+  if (find (logged, logged_cnt, sector, &i))
+    {
+      buffer_unhold (fs_device, sector);
+      logged[i] = logged[--logged_cnt];
+    }
+  if (find (in_log, in_log_cnt, sector, NULL)
+      && !find (revoked, revoked_cnt, sector, NULL))
+    {
+      if (logged_cnt + revoked_cnt < GROUP_MAX)
+        revoked[revoked_cnt++] = sector;
+      else
+        overflow = true;
+    }
+  if (write_back && ordered_cnt < ORDERED_MAX)
+    ordered[ordered_cnt++] = sector;
+  else if (write_back)
+    ordered_overflow = true;
+  lock_release (&journal_lock);
+}
+
+/* Commits the running group. */
+void
+journal_commit (void)
+{
+  commit (false);
+}
+
+/* Commits the running group, then writes every dirty sector in
+   place and empties the log. */
+void
+journal_sync (void)
+{
+  commit (true);
+}
+
+/* Waits for the open handles to end, holding off new ones, and
+   writes the running group to the log.  The free map reaches
+   the cache only when flushed, so it is flushed as part of the
+   group.  If FLUSH is true, then also writes every dirty sector
+   in place and empties the log. */
+static void
+commit (bool flush)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth == 0);
+  lock_acquire (&journal_lock);
+  while (committing)
+    cond_wait (&commit_done, &journal_lock);
+  committing = true;
+  while (handles > 0)
+    cond_wait (&handles_done, &journal_lock);
+  lock_release (&journal_lock);
+
+  t->journal_depth++;
+  free_map_flush ();
+  t->journal_depth--;
+  write_group ();
+  if (flush)
+    {
+      buffer_update_disk ();
+      if (head > 0)
+        empty_log ();
+    }
+
+  lock_acquire (&journal_lock);
+  committing = false;
+  cond_broadcast (&commit_done, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Writes the running group to the log and lets the sectors it
+   logged be written in place.  Does nothing if the group is
+   empty. */
+static void
+write_group (void)
+{
+  struct journal_desc *desc = (struct journal_desc *) group_buf;
+  struct journal_commit *c = (struct journal_commit *) sector_buf;
+  size_t i;
+
+  if (ordered_overflow)
+    buffer_update_disk ();
+  else
+    for (i = 0; i < ordered_cnt; i++)
+      buffer_write_back (fs_device, ordered[i]);
+  ordered_cnt = 0;
+  ordered_overflow = false;
+
+  if (overflow)
+    {
+      /* Too much for one group.  Write it in place instead,
+         which is not atomic, and every earlier group with it. */
+      release_held ();
+      buffer_update_disk ();
+      empty_log ();
+      overflow = false;
+      return;
+    }
+  if (logged_cnt == 0 && revoked_cnt == 0)
+    return;
+  if (head + logged_cnt + 2 > LOG_SECTORS)
+    {
+      /* No room left.  Every group committed so far goes in
+         place, then the log starts over. */
+      buffer_update_disk ();
+      empty_log ();
+    }
+
+  memset (desc, 0, BLOCK_SECTOR_SIZE);
+  desc->magic = DESC_MAGIC;
+  desc->seq = seq;
+  desc->cnt = logged_cnt;
+  desc->rcnt = revoked_cnt;
+  memcpy (desc->sectors, logged, logged_cnt * sizeof *logged);
+  memcpy (desc->sectors + logged_cnt, revoked,
+          revoked_cnt * sizeof *revoked);
+  for (i = 0; i < logged_cnt; i++)
+    buffer_read (fs_device, logged[i],
+                 group_buf + (i + 1) * BLOCK_SECTOR_SIZE, 0,
+                 BLOCK_SECTOR_SIZE);
+  block_write_multi (fs_device, LOG_START + head, logged_cnt + 1, group_buf);
+
+  memset (c, 0, sizeof *c);
+  c->magic = COMMIT_MAGIC;
+  c->seq = seq;
+  c->checksum = hash_bytes (group_buf, (logged_cnt + 1) * BLOCK_SECTOR_SIZE);
+  block_write (fs_device, LOG_START + head + logged_cnt + 1, c);
+  head += logged_cnt + 2;
+  seq++;
+
+  for (i = 0; i < logged_cnt; i++)
+    if (!find (in_log, in_log_cnt, logged[i], NULL))
+      in_log[in_log_cnt++] = logged[i];
+  revoked_cnt = 0;
+  release_held ();
+}
+
+/* Lets every sector the running group logged be written back. */
+static void
+release_held (void)
+{
+  size_t i;
+
+  for (i = 0; i < logged_cnt; i++)
+    buffer_unhold (fs_device, logged[i]);
+  logged_cnt = 0;
+  revoked_cnt = 0;
+}
+
+/* Starts the log over at its first sector, with group SEQ next.
+   Everything in the log must have been written in place. */
+static void
+empty_log (void)
+{
+  struct journal_super *super = (struct journal_super *) sector_buf;
+
+  memset (super, 0, sizeof *super);
+  super->magic = SUPER_MAGIC;
+  super->seq = seq;
+  block_write (fs_device, JOURNAL_SECTOR, super);
+  head = 0;
+  in_log_cnt = 0;
+}
+
+/* Returns true if SECTOR is one of the CNT in ARRAY, and if so
+   stores its index in *IDX unless IDX is null. */
+static bool
+find (const block_sector_t *array, size_t cnt, block_sector_t sector,
+      size_t *idx)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (array[i] == sector)
+      {
+        if (idx != NULL)
+          *idx = i;
+        return true;
+      }
+  return false;
+}
@@ -0,0 +1,28 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+#include "filesys/off_t.h"
+
+/* Write-ahead journal for file system metadata.  Every change to
+   inodes, index sectors, directories and the free map happens
+   inside a handle opened with journal_begin (); the sectors it
+   changes reach their place on disk only after a copy of them is
+   committed to the log.  Handles are grouped, and a group is
+   committed with one sequential write. */
+
+void journal_init (void);
+void journal_create (void);
+void journal_recover (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_dirty (block_sector_t);
+void journal_write (block_sector_t, const void *, off_t offset, off_t size);
+void journal_data (block_sector_t, bool write_back);
+
+void journal_commit (void);
+void journal_sync (void);
+
+#endif /* filesys/journal.h */
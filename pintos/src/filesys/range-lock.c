@@ -0,0 +1,59 @@
+#include "filesys/range-lock.h"
+#include <debug.h>
+
+static bool must_wait (struct range_lock *, struct range *);
+
+/* Initializes RL with no ranges locked. */
+void
+range_lock_init (struct range_lock *rl)
+{
+  lock_init (&rl->lock);
+  cond_init (&rl->released);
+  list_init (&rl->ranges);
+}
+
+/* Locks bytes [START, END) of RL, exclusively if EXCLUSIVE is
+   true, using R to remember it.  Waits as long as an overlapping
+   range that was asked for earlier is held or waited for, unless
+   both are shared.  An empty range never waits. */
+void
+range_lock_acquire (struct range_lock *rl, struct range *r,
+                    off_t start, off_t end, bool exclusive)
+{
+  r->start = start;
+  r->end = end;
+  r->exclusive = exclusive;
+  lock_acquire (&rl->lock);
+  list_push_back (&rl->ranges, &r->elem);
+  while (must_wait (rl, r))
+    cond_wait (&rl->released, &rl->lock);
+  lock_release (&rl->lock);
+}
+
+/* Unlocks R, which range_lock_acquire () locked in RL. */
+void
+range_lock_release (struct range_lock *rl, struct range *r)
+{
+  lock_acquire (&rl->lock);
+  list_remove (&r->elem);
+  cond_broadcast (&rl->released, &rl->lock);
+  lock_release (&rl->lock);
+}
+
+/* Returns true if a range ahead of R in RL conflicts with it.
+   The caller must hold RL's lock. */
+static bool
+must_wait (struct range_lock *rl, struct range *r)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&rl->ranges); e != &r->elem; e = list_next (e))
+    {
+      struct range *other = list_entry (e, struct range, elem);
+      if ((r->exclusive || other->exclusive)
+          && other->start < other->end && r->start < r->end
+          && other->start < r->end && r->start < other->end)
+        return true;
+    }
+  return false;
+}
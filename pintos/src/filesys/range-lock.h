@@ -0,0 +1,35 @@
+#ifndef FILESYS_RANGE_LOCK_H
+#define FILESYS_RANGE_LOCK_H
+
+#include <list.h>
+#include <stdbool.h>
+#include "filesys/off_t.h"
+#include "threads/synch.h"
+
+/* Byte-range lock.  Locks the bytes [START, END) of one file,
+   shared or exclusively; ranges that do not overlap never wait
+   for each other.  Overlapping ranges are granted in the order
+   they were asked for, so a stream of readers cannot starve a
+   writer. */
+struct range_lock
+  {
+    struct lock lock;                   /* Protects RANGES. */
+    struct condition released;          /* Signaled when a range goes. */
+    struct list ranges;                 /* Held and waiting, oldest first. */
+  };
+
+/* A range held or waited for, owned by the caller. */
+struct range
+  {
+    struct list_elem elem;              /* Element in RANGES. */
+    off_t start;                        /* First byte. */
+    off_t end;                          /* One past the last byte. */
+    bool exclusive;                     /* Excludes every other range? */
+  };
+
+void range_lock_init (struct range_lock *);
+void range_lock_acquire (struct range_lock *, struct range *,
+                         off_t start, off_t end, bool exclusive);
+void range_lock_release (struct range_lock *, struct range *);
+
+#endif /* filesys/range-lock.h */
@@ -27,6 +27,7 @@ typedef unsigned long elem_type;
 struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
+    size_t clear_hint;  /* Every bit below this index is true. */
     elem_type *bits;    /* Elements that represent bits. */
   };
 
@@ -68,6 +69,29 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns the index of the first bit in B at or after START and
+   before END that is set to VALUE, or END if there is none.
+   Works a whole element at a time, so runs of bits that all
+   differ from VALUE are skipped ELEM_BITS at a time. */
+static size_t
+find_bit (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      elem_type e = value ? b->bits[idx] : ~b->bits[idx];
+
+      e &= (elem_type) -1 << (start % ELEM_BITS);
+      if (e != 0)
+        {
+          size_t bit = idx * ELEM_BITS + __builtin_ctzl (e);
+          return bit < end ? bit : end;
+        }
+      start = (idx + 1) * ELEM_BITS;
+    }
+  return end;
+}
 
 /* Creation and destruction. */
 
@@ -82,6 +106,7 @@ bitmap_create (size_t bit_cnt)
   if (b != NULL)
     {
       b->bit_cnt = bit_cnt;
+      b->clear_hint = 0;
       b->bits = malloc (byte_cnt (bit_cnt));
       if (b->bits != NULL || bit_cnt == 0)
         {
@@ -104,6 +129,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
   ASSERT (block_size >= bitmap_buf_size (bit_cnt));
 
   b->bit_cnt = bit_cnt;
+  b->clear_hint = 0;
   b->bits = (elem_type *) (b + 1);
   bitmap_set_all (b, false);
   return b;
@@ -163,6 +189,8 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  if (bit_idx == b->clear_hint)
+    b->clear_hint++;
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -176,6 +204,8 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  if (bit_idx < b->clear_hint)
+    b->clear_hint = bit_idx;
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -191,6 +221,8 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  if (bit_idx < b->clear_hint)
+    b->clear_hint = bit_idx;
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -250,16 +282,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_bit (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -291,7 +318,13 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+
+   Each candidate group starts at the next bit set to VALUE and
+   ends at the next bit that is not, both found a word at a time.
+   Searches for false bits begin no earlier than the clear hint,
+   so an allocator that has filled the front of B does not walk
+   over it again on every call. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
@@ -300,11 +333,24 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
 
   if (cnt <= b->bit_cnt) 
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t i = start;
+
+      if (cnt == 0)
+        return start;
+      if (!value && i < b->clear_hint)
+        i = b->clear_hint;
+      while (i + cnt <= b->bit_cnt)
+        {
+          size_t end;
+
+          i = find_bit (b, i, b->bit_cnt, value);
+          if (i + cnt > b->bit_cnt)
+            break;
+          end = find_bit (b, i, i + cnt, !value);
+          if (end == i + cnt)
+            return i;
+          i = end;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -315,13 +361,21 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
    If there is no such group, returns BITMAP_ERROR.
    If CNT is zero, returns 0.
    Bits are set atomically, but testing bits is not atomic with
-   setting them. */
+   setting them.
+
+   After taking false bits, moves the clear hint up to the first
+   false bit, so that the next search skips everything allocated
+   so far even if a bit below the hint was freed in between. */
 size_t
 bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
   size_t idx = bitmap_scan (b, start, cnt, value);
   if (idx != BITMAP_ERROR) 
-    bitmap_set_multiple (b, idx, cnt, !value);
+    {
+      bitmap_set_multiple (b, idx, cnt, !value);
+      if (!value)
+        b->clear_hint = find_bit (b, b->clear_hint, b->bit_cnt, false);
+    }
   return idx;
 }
 
@@ -346,6 +400,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      b->clear_hint = find_bit (b, 0, b->bit_cnt, false);
     }
   return success;
 }
@@ -358,6 +413,29 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes to FILE only the part of B that holds the CNT bits
+   starting at START, at the same offset bitmap_write() would put
+   it, in whole elements.  Return true if successful, false
+   otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t ofs, size;
+
+  ASSERT (b != NULL);
+  if (start >= b->bit_cnt || cnt == 0)
+    return true;
+  if (cnt > b->bit_cnt - start)
+    cnt = b->bit_cnt - start;
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  ofs = first * sizeof (elem_type);
+  size = (last - first + 1) * sizeof (elem_type);
+  return file_write_at (file, b->bits + first, size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -1,5 +1,72 @@
 #include <string.h>
 #include <debug.h>
+#include <stdint.h>
+
+/* Blocks shorter than this are copied, set or compared a byte
+   at a time; aligning and setting up the string instructions
+   would cost more than it saves. */
+#define WORD_THRESHOLD 16
+
+/* A 32-bit word that may alias any other type. */
+typedef uint32_t __attribute__ ((__may_alias__)) word_t;
+
+/* Copies SIZE bytes from SRC to DST, front to back, with
+   "rep movsb" for the unaligned head and the tail and "rep
+   movsl" for the words in between.  Also safe for overlapping
+   blocks with DST below SRC. */
+static void
+copy_forward (unsigned char *dst, const unsigned char *src, size_t size)
+{
+  if (size >= WORD_THRESHOLD)
+    {
+      /* Align DST to a word boundary. */
+      size_t head = -(uintptr_t) dst & (sizeof (word_t) - 1);
+      size_t words;
+
+      size -= head;
+      asm volatile ("rep movsb"
+                    : "+D" (dst), "+S" (src), "+c" (head) : : "memory");
+      words = size / sizeof (word_t);
+      size %= sizeof (word_t);
+      asm volatile ("rep movsl"
+                    : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+    }
+  asm volatile ("rep movsb"
+                : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+}
+
+/* Copies SIZE bytes from SRC to DST, back to front, using the
+   string instructions with the direction flag set.  Safe for
+   overlapping blocks with DST above SRC. */
+static void
+copy_backward (unsigned char *dst, const unsigned char *src, size_t size)
+{
+  /* Point at the last byte of each block. */
+  dst += size - 1;
+  src += size - 1;
+  if (size >= WORD_THRESHOLD)
+    {
+      /* Align the end of DST to a word boundary. */
+      size_t tail = ((uintptr_t) dst + 1) & (sizeof (word_t) - 1);
+      size_t words;
+
+      size -= tail;
+      asm volatile ("std; rep movsb; cld"
+                    : "+D" (dst), "+S" (src), "+c" (tail) : : "memory");
+      words = size / sizeof (word_t);
+      size %= sizeof (word_t);
+      /* "rep movsl" going down wants the address of the last word,
+         not of its last byte. */
+      dst -= sizeof (word_t) - 1;
+      src -= sizeof (word_t) - 1;
+      asm volatile ("std; rep movsl; cld"
+                    : "+D" (dst), "+S" (src), "+c" (words) : : "memory");
+      dst += sizeof (word_t) - 1;
+      src += sizeof (word_t) - 1;
+    }
+  asm volatile ("std; rep movsb; cld"
+                : "+D" (dst), "+S" (src), "+c" (size) : : "memory");
+}
 
 /* Copies SIZE bytes from SRC to DST, which must not overlap.
    Returns DST. */
@@ -12,8 +79,7 @@ memcpy (void *dst_, const void *src_, size_t size)
   ASSERT (dst != NULL || size == 0);
   ASSERT (src != NULL || size == 0);
 
-  while (size-- > 0)
-    *dst++ = *src++;
+  copy_forward (dst, src, size);
 
   return dst_;
 }
@@ -29,20 +95,14 @@ memmove (void *dst_, const void *src_, size_t size)
   ASSERT (dst != NULL || size == 0);
   ASSERT (src != NULL || size == 0);
 
-  if (dst < src) 
-    {
-      while (size-- > 0)
-        *dst++ = *src++;
-    }
+  if (size == 0 || dst == src)
+    return dst_;
+  if (dst < src || dst >= src + size) 
+    copy_forward (dst, src, size);
   else 
-    {
-      dst += size;
-      src += size;
-      while (size-- > 0)
-        *--dst = *--src;
-    }
+    copy_backward (dst, src, size);
 
-  return dst;
+  return dst_;
 }
 
 /* Find the first differing byte in the two blocks of SIZE bytes
@@ -58,6 +118,15 @@ memcmp (const void *a_, const void *b_, size_t size)
   ASSERT (a != NULL || size == 0);
   ASSERT (b != NULL || size == 0);
 
+  /* Skip equal words, then find the differing byte, if any, in
+     the first word that differs. */
+  for (; size >= sizeof (word_t); size -= sizeof (word_t))
+    {
+      if (*(const word_t *) a != *(const word_t *) b)
+        break;
+      a += sizeof (word_t);
+      b += sizeof (word_t);
+    }
   for (; size-- > 0; a++, b++)
     if (*a != *b)
       return *a > *b ? +1 : -1;
@@ -274,16 +343,34 @@ strtok_r (char *s, const char *delimiters, char **save_ptr)
   return token;
 }
 
-/* Sets the SIZE bytes in DST to VALUE. */
+/* Sets the SIZE bytes in DST to VALUE, with "rep stosb" for
+   the unaligned head and the tail and "rep stosl" for the words
+   in between. */
 void *
 memset (void *dst_, int value, size_t size) 
 {
   unsigned char *dst = dst_;
+  uint32_t byte = (unsigned char) value;
 
   ASSERT (dst != NULL || size == 0);
   
-  while (size-- > 0)
-    *dst++ = value;
+  if (size >= WORD_THRESHOLD)
+    {
+      /* Align DST to a word boundary. */
+      size_t head = -(uintptr_t) dst & (sizeof (word_t) - 1);
+      size_t words;
+
+      size -= head;
+      asm volatile ("rep stosb"
+                    : "+D" (dst), "+c" (head) : "a" (byte) : "memory");
+      words = size / sizeof (word_t);
+      size %= sizeof (word_t);
+      asm volatile ("rep stosl"
+                    : "+D" (dst), "+c" (words) : "a" (byte * 0x01010101)
+                    : "memory");
+    }
+  asm volatile ("rep stosb"
+                : "+D" (dst), "+c" (size) : "a" (byte) : "memory");
 
   return dst_;
 }
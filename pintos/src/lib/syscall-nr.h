@@ -33,7 +33,9 @@ enum
     SYS_BUFFER_CLEAN,           /* Invalidates every entry in buffer cache */
     SYS_BUFFER_HIT_RATE,         /* Invalidates every entry in buffer cache */
     SYS_BUFFER_READ_NUM,
-    SYS_BUFFER_WRITE_NUM
+    SYS_BUFFER_WRITE_NUM,
+    SYS_OPEN_DIRECT,            /* Open a file for direct I/O. */
+    SYS_TICKS                   /* Returns timer ticks since boot. */
   };
 
 #endif /* lib/syscall-nr.h */
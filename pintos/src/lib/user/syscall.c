@@ -212,3 +212,15 @@ buffer_write_num(void)
 {
   return syscall0 (SYS_BUFFER_WRITE_NUM);
 }
+
+int
+open_direct (const char *file)
+{
+  return syscall1 (SYS_OPEN_DIRECT, file);
+}
+
+int
+get_ticks (void)
+{
+  return syscall0 (SYS_TICKS);
+}
@@ -49,5 +49,7 @@ int buffer_read_num (void);
 int buffer_write_num(void);
 void buffer_clean();
 int buffer_hit_rate();
+int open_direct (const char *file);
+int get_ticks (void);
 
 #endif /* lib/user/syscall.h */
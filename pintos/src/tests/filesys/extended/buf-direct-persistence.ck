@@ -0,0 +1,6 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({'a' => ["\2" x 100 . "\3" x (32 * 512 - 200) . "\2" x 100]});
+pass;
@@ -0,0 +1,52 @@
+/* Writes a file through the buffer cache and reads it back with
+   direct I/O, then the other way around, and finally with an
+   unaligned direct write that goes partly through the cache, to
+   check that the two paths see each other's data. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (32 * 512)
+#define EDGE 100
+
+static char buf[FILE_SIZE];
+static char cmp[FILE_SIZE];
+
+void
+test_main (void) 
+{
+  int fd, dfd;
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK ((fd = open ("a")) > 1, "open \"a\"");
+  CHECK ((dfd = open_direct ("a")) > 1, "open_direct \"a\"");
+
+  memset (buf, 1, sizeof buf);
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf,
+         "write \"a\" through the cache");
+  CHECK (read (dfd, cmp, sizeof cmp) == sizeof cmp, "read \"a\" directly");
+  compare_bytes (cmp, buf, sizeof buf, 0, "a");
+
+  memset (buf, 2, sizeof buf);
+  seek (dfd, 0);
+  CHECK (write (dfd, buf, sizeof buf) == sizeof buf, "write \"a\" directly");
+  seek (fd, 0);
+  CHECK (read (fd, cmp, sizeof cmp) == sizeof cmp,
+         "read \"a\" through the cache");
+  compare_bytes (cmp, buf, sizeof buf, 0, "a");
+
+  memset (buf + EDGE, 3, sizeof buf - 2 * EDGE);
+  seek (dfd, EDGE);
+  CHECK (write (dfd, buf + EDGE, sizeof buf - 2 * EDGE)
+         == sizeof buf - 2 * EDGE, "write \"a\" directly, unaligned");
+  seek (fd, 0);
+  CHECK (read (fd, cmp, sizeof cmp) == sizeof cmp,
+         "read \"a\" through the cache");
+  compare_bytes (cmp, buf, sizeof buf, 0, "a");
+
+  msg ("close \"a\"");
+  close (fd);
+  close (dfd);
+}
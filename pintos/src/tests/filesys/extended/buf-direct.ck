@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(buf-direct) begin
+(buf-direct) create "a"
+(buf-direct) open "a"
+(buf-direct) open_direct "a"
+(buf-direct) write "a" through the cache
+(buf-direct) read "a" directly
+(buf-direct) write "a" directly
+(buf-direct) read "a" through the cache
+(buf-direct) write "a" directly, unaligned
+(buf-direct) read "a" through the cache
+(buf-direct) close "a"
+(buf-direct) end
+EOF
+pass;
@@ -0,0 +1,57 @@
+/* Child process for syn-dir.
+   Creates FILE_CNT files in its own directory, or in the shared
+   one if its second argument is "shared", removes them all
+   again, and repeats that ROUND_CNT times while the other
+   children do the same. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/filesys/extended/syn-dir.h"
+#include "tests/lib.h"
+
+const char *test_name = "child-syn-dir";
+
+/* Sets NAME, which has room for 32 bytes, to the name of file
+   number FILE of child CHILD_IDX in the shared directory if
+   SHARED is true, otherwise in the child's own directory. */
+static void
+file_name (char *name, int child_idx, int file, bool shared)
+{
+  if (shared)
+    snprintf (name, 32, "%s/c%d-%d", shared_name, child_idx, file);
+  else
+    snprintf (name, 32, "d%d/f%d", child_idx, file);
+}
+
+int
+main (int argc, const char *argv[]) 
+{
+  char name[32];
+  int child_idx;
+  bool shared;
+  int round, file;
+
+  quiet = true;
+
+  CHECK (argc == 3, "argc must be 3, actually %d", argc);
+  child_idx = atoi (argv[1]);
+  shared = !strcmp (argv[2], "shared");
+
+  for (round = 0; round < ROUND_CNT; round++)
+    {
+      for (file = 0; file < FILE_CNT; file++)
+        {
+          file_name (name, child_idx, file, shared);
+          CHECK (create (name, 0), "create \"%s\"", name);
+        }
+      for (file = 0; file < FILE_CNT; file++)
+        {
+          file_name (name, child_idx, file, shared);
+          CHECK (remove (name), "remove \"%s\"", name);
+        }
+    }
+
+  return child_idx;
+}
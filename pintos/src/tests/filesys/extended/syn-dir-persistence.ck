@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({"child-syn-dir" => "tests/filesys/extended/child-syn-dir",
+		"shared" => {}, "d0" => {}, "d1" => {}, "d2" => {}, "d3" => {}});
+pass;
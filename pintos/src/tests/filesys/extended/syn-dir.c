@@ -0,0 +1,63 @@
+/* Creates and removes files from multiple processes at once,
+   first each in a directory of its own and then all in one
+   shared directory, and reports how many timer ticks each run
+   took.  Children working in separate directories take separate
+   directory locks, so they should not be slower than children
+   that all take the shared directory's lock.  Then makes sure
+   that the shared directory was left empty. */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/filesys/extended/syn-dir.h"
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Runs CHILD_CNT children, all working in the shared directory
+   if SHARED is true, otherwise each in its own, and returns the
+   number of timer ticks until the last one exits. */
+static int
+run_children (bool shared)
+{
+  pid_t children[CHILD_CNT];
+  int start;
+  int i;
+
+  start = get_ticks ();
+  for (i = 0; i < CHILD_CNT; i++)
+    {
+      char cmd_line[128];
+      snprintf (cmd_line, sizeof cmd_line, "child-syn-dir %d %s",
+                i, shared ? "shared" : "own");
+      CHECK ((children[i] = exec (cmd_line)) != PID_ERROR,
+             "exec child %d of %d: \"%s\"", i + 1, CHILD_CNT, cmd_line);
+    }
+  wait_children (children, CHILD_CNT);
+  return get_ticks () - start;
+}
+
+void
+test_main (void) 
+{
+  char name[READDIR_MAX_LEN + 1];
+  int own_ticks, shared_ticks;
+  int fd;
+  int i;
+
+  CHECK (mkdir (shared_name), "mkdir \"%s\"", shared_name);
+  for (i = 0; i < CHILD_CNT; i++)
+    {
+      snprintf (name, sizeof name, "d%d", i);
+      CHECK (mkdir (name), "mkdir \"%s\"", name);
+    }
+
+  own_ticks = run_children (false);
+  shared_ticks = run_children (true);
+  msg ("own directories: %d ticks", own_ticks);
+  msg ("shared directory: %d ticks", shared_ticks);
+
+  CHECK ((fd = open (shared_name)) > 1, "open \"%s\"", shared_name);
+  CHECK (!readdir (fd, name), "readdir \"%s\" (must return false)",
+         shared_name);
+  close (fd);
+}
@@ -0,0 +1,43 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+
+# The tick counts vary from run to run, so check that both are
+# reported and leave them out of the comparison.
+my ($timing) =
+  qr/^\(syn-dir\) (own directories|shared directory): \d+ ticks$/;
+my (@output) = read_text_file ("$test.output");
+common_checks ("run", @output);
+fail "missing tick counts\n" if grep (/$timing/, @output) != 2;
+@output = grep (!/$timing/, @output);
+compare_output ("run", IGNORE_EXIT_CODES => 1, \@output, [<<'EOF']);
+(syn-dir) begin
+(syn-dir) mkdir "shared"
+(syn-dir) mkdir "d0"
+(syn-dir) mkdir "d1"
+(syn-dir) mkdir "d2"
+(syn-dir) mkdir "d3"
+(syn-dir) exec child 1 of 4: "child-syn-dir 0 own"
+(syn-dir) exec child 2 of 4: "child-syn-dir 1 own"
+(syn-dir) exec child 3 of 4: "child-syn-dir 2 own"
+(syn-dir) exec child 4 of 4: "child-syn-dir 3 own"
+(syn-dir) wait for child 1 of 4 returned 0 (expected 0)
+(syn-dir) wait for child 2 of 4 returned 1 (expected 1)
+(syn-dir) wait for child 3 of 4 returned 2 (expected 2)
+(syn-dir) wait for child 4 of 4 returned 3 (expected 3)
+(syn-dir) exec child 1 of 4: "child-syn-dir 0 shared"
+(syn-dir) exec child 2 of 4: "child-syn-dir 1 shared"
+(syn-dir) exec child 3 of 4: "child-syn-dir 2 shared"
+(syn-dir) exec child 4 of 4: "child-syn-dir 3 shared"
+(syn-dir) wait for child 1 of 4 returned 0 (expected 0)
+(syn-dir) wait for child 2 of 4 returned 1 (expected 1)
+(syn-dir) wait for child 3 of 4 returned 2 (expected 2)
+(syn-dir) wait for child 4 of 4 returned 3 (expected 3)
+(syn-dir) open "shared"
+(syn-dir) readdir "shared" (must return false)
+(syn-dir) end
+EOF
+pass;
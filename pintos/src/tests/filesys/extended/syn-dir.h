@@ -0,0 +1,9 @@
+#ifndef TESTS_FILESYS_EXTENDED_SYN_DIR_H
+#define TESTS_FILESYS_EXTENDED_SYN_DIR_H
+
+#define CHILD_CNT 4
+#define ROUND_CNT 8
+#define FILE_CNT 16
+static const char shared_name[] = "shared";
+
+#endif /* tests/filesys/extended/syn-dir.h */
@@ -0,0 +1,122 @@
+/* Test program for lib/kernel/bitmap.c.
+
+   Checks bitmap_scan() against a straightforward bit-by-bit
+   search on a fragmented bitmap, then reports how many timer
+   ticks each takes to run the same scans.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <bitmap.h>
+#include <debug.h>
+#include <inttypes.h>
+#include <random.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/test.h"
+
+/* Number of bits in the test bitmap. */
+#define BIT_CNT 65536
+
+/* Number of times each group size is scanned for. */
+#define ROUNDS 16
+
+static void fragment (struct bitmap *);
+static size_t slow_scan (const struct bitmap *, size_t start, size_t cnt,
+                         bool value);
+
+/* Compare bitmap_scan() with slow_scan(). */
+void
+test (void)
+{
+  static const size_t sizes[] = {1, 4, 16, 64};
+  struct bitmap *b;
+  size_t i;
+
+  b = bitmap_create (BIT_CNT);
+  ASSERT (b != NULL);
+  random_init (0);
+  fragment (b);
+
+  printf ("scanning %d-bit map, %zu bits free:\n",
+          BIT_CNT, bitmap_count (b, 0, BIT_CNT, false));
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    {
+      size_t cnt = sizes[i];
+      int64_t start;
+      int64_t fast_ticks, slow_ticks;
+      size_t fast = 0, slow = 0;
+      int round;
+
+      start = timer_ticks ();
+      for (round = 0; round < ROUNDS; round++)
+        fast = bitmap_scan (b, round, cnt, false);
+      fast_ticks = timer_elapsed (start);
+
+      start = timer_ticks ();
+      for (round = 0; round < ROUNDS; round++)
+        slow = slow_scan (b, round, cnt, false);
+      slow_ticks = timer_elapsed (start);
+
+      ASSERT (fast == slow);
+      printf (" cnt=%3zu: word scan %"PRId64" ticks, "
+              "bit scan %"PRId64" ticks\n", cnt, fast_ticks, slow_ticks);
+    }
+
+  /* Allocating repeatedly must still hand out the lowest free
+     group each time now that scans start from the clear hint. */
+  for (i = 0; i < 1024; i++)
+    {
+      size_t cnt = i % 3 + 1;
+      size_t expect = slow_scan (b, 0, cnt, false);
+      size_t got = bitmap_scan_and_flip (b, 0, cnt, false);
+
+      ASSERT (got == expect);
+      if (got != BITMAP_ERROR && i % 5 == 0)
+        bitmap_reset (b, got);
+    }
+
+  bitmap_destroy (b);
+  printf ("done\n");
+}
+
+/* Sets about three quarters of the bits in B in short random
+   runs, so that free runs are few and short and the free bits
+   that remain mostly sit in words with set bits. */
+static void
+fragment (struct bitmap *b)
+{
+  size_t i = 0;
+
+  while (i < bitmap_size (b))
+    {
+      size_t used = random_ulong () % 24 + 1;
+      size_t gap = random_ulong () % 8 + 1;
+
+      if (used > bitmap_size (b) - i)
+        used = bitmap_size (b) - i;
+      bitmap_set_multiple (b, i, used, true);
+      i += used + gap;
+    }
+}
+
+/* Finds the first group of CNT bits in B at or after START that
+   are all VALUE by testing one bit at a time, the way
+   bitmap_scan() used to. */
+static size_t
+slow_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
+{
+  size_t i, j;
+
+  for (i = start; i + cnt <= bitmap_size (b); i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j) != value)
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
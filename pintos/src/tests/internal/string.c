@@ -0,0 +1,116 @@
+/* Micro-benchmark for the block functions in lib/string.c.
+
+   Measures how many bytes per cycle memcpy(), memmove(),
+   memset() and memcmp() process for a range of block sizes, with
+   aligned and misaligned buffers, and checks their results along
+   the way.
+
+   This is not a test we will run on your submitted projects.
+   It is here for completeness.
+*/
+
+#undef NDEBUG
+#include <debug.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/test.h"
+
+/* Largest block size that we will measure. */
+#define MAX_SIZE 4096
+
+/* Times each measurement is repeated. */
+#define REPEAT 64
+
+static uint8_t src_buf[MAX_SIZE + 8];
+static uint8_t dst_buf[MAX_SIZE + 8];
+
+static uint64_t rdtsc (void);
+static void report (const char *name, size_t size, size_t ofs,
+                    uint64_t cycles);
+static void fill (uint8_t *, size_t);
+
+/* Measure the block functions. */
+void
+test (void) 
+{
+  static const size_t sizes[] = {16, 64, 512, 4096};
+  size_t i;
+
+  printf ("bytes per 100 cycles (higher is better):\n");
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++)
+    {
+      size_t size = sizes[i];
+      size_t ofs;
+
+      /* Offset 0 is word aligned, offsets 1 and 3 are not. */
+      for (ofs = 0; ofs < 4; ofs += ofs == 0 ? 1 : 2)
+        {
+          uint8_t *src = src_buf + ofs;
+          uint8_t *dst = dst_buf;
+          uint64_t start;
+          int differ;
+          int r;
+
+          fill (src, size);
+
+          start = rdtsc ();
+          for (r = 0; r < REPEAT; r++)
+            memcpy (dst, src, size);
+          report ("memcpy", size, ofs, rdtsc () - start);
+          ASSERT (!memcmp (dst, src, size));
+
+          differ = 0;
+          start = rdtsc ();
+          for (r = 0; r < REPEAT; r++)
+            differ |= memcmp (dst, src, size);
+          report ("memcmp", size, ofs, rdtsc () - start);
+          ASSERT (differ == 0);
+
+          /* Overlapping move up by a few bytes, which takes the
+             backward path. */
+          start = rdtsc ();
+          for (r = 0; r < REPEAT; r++)
+            memmove (src_buf + 4, src, size);
+          report ("memmove", size, ofs, rdtsc () - start);
+
+          start = rdtsc ();
+          for (r = 0; r < REPEAT; r++)
+            memset (dst + ofs, 0x5a, size);
+          report ("memset", size, ofs, rdtsc () - start);
+          ASSERT (memchr (dst + ofs, 0x5a ^ 1, size) == NULL);
+        }
+    }
+}
+
+/* Returns the processor's time-stamp counter. */
+static uint64_t
+rdtsc (void) 
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Prints the throughput of REPEAT calls to NAME on SIZE bytes at
+   offset OFS that took CYCLES in total. */
+static void
+report (const char *name, size_t size, size_t ofs, uint64_t cycles) 
+{
+  uint64_t bytes = (uint64_t) size * REPEAT * 100;
+
+  if (cycles == 0)
+    cycles = 1;
+  printf ("%-8s size %4zu offset %zu: %5"PRIu64"\n",
+          name, size, ofs, bytes / cycles);
+}
+
+/* Fills the SIZE bytes at P with a recognizable pattern. */
+static void
+fill (uint8_t *p, size_t size) 
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    p[i] = i * 7 + 1;
+}
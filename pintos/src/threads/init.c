@@ -36,6 +36,8 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/buffer.h"
+#include "filesys/inode.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -247,6 +249,43 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        {
+          int sectors = value != NULL ? atoi (value) : 0;
+          if (sectors < BUFFER_MIN_SECTORS || sectors > BUFFER_MAX_SECTORS)
+            PANIC ("cache size must be between %d and %d sectors",
+                   BUFFER_MIN_SECTORS, BUFFER_MAX_SECTORS);
+          buffer_max_sectors = sectors;
+        }
+      else if (!strcmp (name, "-wb"))
+        {
+          int ticks = value != NULL ? atoi (value) : -1;
+          if (ticks < 0)
+            PANIC ("write-behind period must not be negative");
+          buffer_write_behind_ticks = ticks;
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (value == NULL)
+            PANIC ("option `%s' requires a value", name);
+          else if (!strcmp (value, "lru"))
+            buffer_policy = BUFFER_LRU;
+          else if (!strcmp (value, "clock"))
+            buffer_policy = BUFFER_CLOCK;
+          else
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-inode-format"))
+        {
+          if (value == NULL)
+            PANIC ("option `%s' requires a value", name);
+          else if (!strcmp (value, "indexed"))
+            inode_format = INODE_INDEXED;
+          else if (!strcmp (value, "extents"))
+            inode_format = INODE_EXTENTS;
+          else
+            PANIC ("unknown inode format `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -373,6 +412,10 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=N           Let the buffer cache grow up to N sectors (192+).\n"
+          "  -cache-policy=POL  Use POL (lru or clock) to evict cached sectors.\n"
+          "  -wb=TICKS          Write back dirty sectors every TICKS (0: never).\n"
+          "  -inode-format=FMT  Create inodes as FMT (indexed or extents).\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -474,6 +474,7 @@ init_thread (struct thread *t, const char *name, int priority)
 
   // Initialize the curr_dir to be NULL which represents root
   t->curr_dir = NULL;
+  t->journal_depth = 0;
 
   old_level = intr_disable ();
   list_push_back (&all_list, &t->allelem);
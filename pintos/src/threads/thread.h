@@ -119,6 +119,7 @@ struct thread
 
   // ADDED BY HUGH
   struct dir *curr_dir; /* Current directory for the thread */
+  int journal_depth;    /* Nesting of open journal handles */
 
   //
 #ifdef USERPROG
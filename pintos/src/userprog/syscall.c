@@ -9,6 +9,7 @@
 #include "filesys/filesys.h"
 #include "filesys/file.h"
 #include "devices/input.h"
+#include "devices/timer.h"
 #include "kernel/stdio.h"
 #include "filesys/buffer.h"
 
@@ -26,7 +27,7 @@ static bool is_valid_pointer (uint32_t *pd, void* buffer, int32_t size);
 static bool is_args_valid(int num_args, uint32_t* args);
 static int32_t sys_write_handler (int fd, void* buffer, int32_t size);
 static int32_t sys_read_handler (int fd, void* buffer, int32_t size);
-static int32_t sys_open_handler (char *name);
+static int32_t sys_open_handler (char *name, bool direct);
 
 void
 syscall_init (void)
@@ -125,7 +126,7 @@ syscall_handler (struct intr_frame *f UNUSED)
       sys_exit_handler(-1);
     }
     char* name = (char*) (args[1]);
-    int fd = sys_open_handler(name);
+    int fd = sys_open_handler(name, false);
     f->eax = fd;
     // printf("inside open %d, %s\n", fd, name);
     if (fd == -1)
@@ -384,6 +385,7 @@ syscall_handler (struct intr_frame *f UNUSED)
   }
   else if (args[0] == SYS_BUFFER_CLEAN)
   {
+      filesys_sync ();
       buffer_clean();
   }
   else if (args[0] == SYS_BUFFER_HIT_RATE)
@@ -401,6 +403,29 @@ syscall_handler (struct intr_frame *f UNUSED)
   {
       f->eax = get_fs_device_write_cnt(fs_device);
   }
+  else if (args[0] == SYS_OPEN_DIRECT)
+  {
+    if(!is_args_valid(2, args))
+    {
+      f->eax = -1;
+      sys_exit_handler(-1);
+    }
+    char* name = (char*) (args[1]);
+    int fd = sys_open_handler(name, true);
+    f->eax = fd;
+    if (fd == -1)
+    {
+      sys_exit_handler(-1);
+    }
+    else if (fd == -2)
+    {
+      f->eax = -1;
+    }
+  }
+  else if (args[0] == SYS_TICKS)
+  {
+      f->eax = timer_ticks ();
+  }
 }
 
 /**
@@ -516,12 +541,13 @@ sys_write_handler (int fd, void* buffer, int32_t size)
 /**
  *  function to handle the open call, it will check the name pointer
  *  is valid. If so, it open the file, and find a smallest fd number
- *  to return. Meanwhile add the fd struct to the list.
+ *  to return. Meanwhile add the fd struct to the list. If DIRECT,
+ *  reads and writes of a file bypass the buffer cache.
  **/
  // this need to open either file or dir
  // when open a thing, first try the name of file, if failed try dir
 static int32_t
-sys_open_handler (char *name)
+sys_open_handler (char *name, bool direct)
 {
   struct thread *t = thread_current ();
   uint32_t *pd = t->pagedir;
@@ -542,6 +568,8 @@ sys_open_handler (char *name)
       }
     } else {
       // it's a file
+      if (direct)
+        file_set_direct (file_pointer);
       int res_fd = find_free_fd(fd_list, file_pointer, NULL, false);
       return(res_fd);
     }